@@ -15,7 +15,21 @@
 #define PLATFORM_WINDOWS  1
 #define PLATFORM_MAC      2
 #define PLATFORM_UNIX     3
-const int PacketSizeHack = 384;
+const int MaxPacketBatch = 64;
+const int MaxOffloadSize = 65507;			// largest udp payload, bounds GSO super-buffers and GRO coalesced reads
+const int DefaultMaxPacketSize = 1472;		// ethernet mtu less ip and udp headers
+const int BasePacketSize = 1200;			// datagram size assumed to fit any path (DPLPMTUD BASE_PLPMTU)
+const float ProbeTimeout = 1.0f;			// seconds before an unanswered path mtu probe counts as lost
+const float ProbeRaiseTime = 600.0f;		// seconds between path mtu searches (DPLPMTUD PMTU_RAISE_TIMER)
+const int MaxZeroCopyInFlight = 1024;
+const int MaxSegments = 8;					// most buffers one datagram is gathered from or scattered into (see Segment)
+const int CacheLineSize = 64;
+const float HandshakeRetryTime = 0.25f;		// seconds between connect handshake retries
+const unsigned int CookieLifetime = 10;		// seconds a connect cookie stays valid
+const int CompactHeaderMinSize = 4;		// compact reliability header: flags, 16 bit sequence, ack as one byte difference
+const int CompactHeaderMaxSize = 41;		// ... with a 16 bit ack and all MaxAckBits / 8 ack bits bytes, see compact_header_max_size
+const int MaxAckBits = 256;				// widest ack bits a connection can agree on (see ConnectOption), 32 unless agreed
+const int ReliabilityHeaderMaxSize = 8 + MaxAckBits / 8;	// full reliability header with the widest ack bits
 
 #if defined(_WIN32)
 #define PLATFORM PLATFORM_WINDOWS
@@ -28,14 +42,66 @@ const int PacketSizeHack = 384;
 #if PLATFORM == PLATFORM_WINDOWS
 
 #include <winsock2.h>
+#include <intrin.h>
 #pragma comment( lib, "wsock32.lib" )
 
 #elif PLATFORM == PLATFORM_MAC || PLATFORM == PLATFORM_UNIX
 
 #include <sys/socket.h>
+#include <sys/select.h>
 #include <netinet/in.h>
 #include <fcntl.h>
 
+#if defined(__linux__)
+#include <netinet/udp.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <pthread.h>
+#include <sched.h>
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#ifndef SO_RXQ_OVFL
+#define SO_RXQ_OVFL 40
+#endif
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#ifndef SO_MAX_PACING_RATE
+#define SO_MAX_PACING_RATE 47
+#endif
+#ifndef SO_TXTIME
+#define SO_TXTIME 61
+#define SCM_TXTIME SO_TXTIME
+#endif
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+#endif
+
+#if defined(NET_IO_URING) && defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
 #else
 
 #error unknown platform!
@@ -43,12 +109,15 @@ const int PacketSizeHack = 384;
 #endif
 
 #include <assert.h>
+#include <atomic>
 #include <vector>
 #include <map>
 #include <stack>
 #include <list>
 #include <algorithm>
 #include <functional>
+#include <chrono>
+#include <random>
 
 namespace net
 {
@@ -68,6 +137,39 @@ namespace net
 
 #endif
 
+	// wall clock time in nanoseconds, the same clock the kernel stamps received packets with (SO_TIMESTAMPNS)
+
+	inline long long timestamp_now()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	// monotonic time in nanoseconds, the clock SO_TXTIME transmit times are given in (steady_clock is CLOCK_MONOTONIC on linux)
+
+	inline long long monotonic_now()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// pin the calling thread to one cpu, so a busy-polling loop keeps its core and cache to itself
+
+	inline bool pin_thread(int cpu)
+	{
+#if defined(__linux__)
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+		{
+			printf("failed to pin thread to cpu %d\n", cpu);
+			return false;
+		}
+		return true;
+#else
+		return false;
+#endif
+	}
+
 	// internet address
 
 	class Address
@@ -149,938 +251,6065 @@ namespace net
 		unsigned short port;
 	};
 
-	// sockets
+	// address hashing: ipv4 address and port packed into one 48 bit key, then mixed (murmur3 finalizer)
 
-	inline bool InitializeSockets()
+	inline unsigned long long address_key(const Address& address)
 	{
-#if PLATFORM == PLATFORM_WINDOWS
-		WSADATA WsaData;
-		return WSAStartup(MAKEWORD(2, 2), &WsaData) == NO_ERROR;
-#else
-		return true;
-#endif
+		return ((unsigned long long)address.GetAddress() << 16) | address.GetPort();
 	}
 
-	inline void ShutdownSockets()
+	inline unsigned long long hash_address_key(unsigned long long key)
 	{
-#if PLATFORM == PLATFORM_WINDOWS
-		WSACleanup();
-#endif
+		key ^= key >> 33;
+		key *= 0xFF51AFD7ED558CCDULL;
+		key ^= key >> 33;
+		key *= 0xC4CEB9FE1A85EC53ULL;
+		key ^= key >> 33;
+		return key;
+	}
+
+	inline unsigned long long hash_address(const Address& address)
+	{
+		return hash_address_key(address_key(address));
 	}
 
-	class Socket
+	// so address can be a key in std::unordered_map too
+
+	struct AddressHash
+	{
+		size_t operator()(const Address& address) const
+		{
+			return (size_t)hash_address(address);
+		}
+	};
+
+	// open addressing hash table from address to value (robin hood hashing)
+	//  + each slot is one 64 bit word: the 48 bit address key and its probe distance + 1 above it, zero when empty
+	//  + values live in a parallel array, so probing touches eight slots per cache line and no pointers
+	//  + erase shifts the following entries back instead of leaving tombstones
+	//  + meant for small values such as pointers, iterate with GetCapacity/IsUsed/GetKey/GetValue
+
+	template <typename T> class AddressTable
 	{
 	public:
 
-		Socket()
+		AddressTable(int capacity = 16)
 		{
-			socket = 0;
+			count = 0;
+			Allocate(capacity);
 		}
 
-		~Socket()
+		// make room for count entries without growing on insert
+
+		void Reserve(int count)
 		{
-			Close();
+			int capacity = GetCapacity();
+			while (count * 8 > capacity * 7)
+				capacity *= 2;
+			if (capacity != GetCapacity())
+				Rehash(capacity);
 		}
 
-		bool Open(unsigned short port)
+		int GetCount() const
 		{
-			assert(!IsOpen());
+			return count;
+		}
 
-			// create socket
+		int GetCapacity() const
+		{
+			return (int)slots.size();
+		}
 
-			socket = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		void Clear()
+		{
+			std::fill(slots.begin(), slots.end(), 0ULL);
+			std::fill(values.begin(), values.end(), T());
+			count = 0;
+		}
 
-			if (socket <= 0)
-			{
-				printf("failed to create socket\n");
-				socket = 0;
-				return false;
-			}
+		T* Find(const Address& address)
+		{
+			const int index = FindIndex(address_key(address));
+			return index >= 0 ? &values[index] : NULL;
+		}
 
-			// bind to port
+		const T* Find(const Address& address) const
+		{
+			const int index = FindIndex(address_key(address));
+			return index >= 0 ? &values[index] : NULL;
+		}
 
-			sockaddr_in address;
-			address.sin_family = AF_INET;
-			address.sin_addr.s_addr = INADDR_ANY;
-			address.sin_port = htons((unsigned short)port);
+		// returns false if the address is already in the table
 
-			if (::bind(socket, (const sockaddr*)&address, sizeof(sockaddr_in)) < 0)
-			{
-				printf("failed to bind socket\n");
-				Close();
+		bool Insert(const Address& address, const T& value)
+		{
+			const unsigned long long key = address_key(address);
+			if (FindIndex(key) >= 0)
 				return false;
-			}
-
-			// set non-blocking io
-
-#if PLATFORM == PLATFORM_MAC || PLATFORM == PLATFORM_UNIX
+			if ((count + 1) * 8 > GetCapacity() * 7)
+				Rehash(GetCapacity() * 2);
+			Place(key, value);
+			count++;
+			return true;
+		}
 
-			int nonBlocking = 1;
-			if (fcntl(socket, F_SETFL, O_NONBLOCK, nonBlocking) == -1)
-			{
-				printf("failed to set non-blocking socket\n");
-				Close();
+		bool Erase(const Address& address)
+		{
+			int index = FindIndex(address_key(address));
+			if (index < 0)
 				return false;
-			}
-
-#elif PLATFORM == PLATFORM_WINDOWS
-
-			DWORD nonBlocking = 1;
-			if (ioctlsocket(socket, FIONBIO, &nonBlocking) != 0)
+			int next = (index + 1) & mask;
+			while (slots[next] != 0 && Distance(slots[next]) > 0)
 			{
-				printf("failed to set non-blocking socket\n");
-				Close();
-				return false;
+				slots[index] = slots[next] - (1ULL << DistanceShift);
+				values[index] = values[next];
+				index = next;
+				next = (next + 1) & mask;
 			}
-
-#endif
-
+			slots[index] = 0;
+			values[index] = T();
+			count--;
 			return true;
 		}
 
-		void Close()
+		bool IsUsed(int index) const
 		{
-			if (socket != 0)
-			{
-#if PLATFORM == PLATFORM_MAC || PLATFORM == PLATFORM_UNIX
-				close(socket);
-#elif PLATFORM == PLATFORM_WINDOWS
-				closesocket(socket);
-#endif
-				socket = 0;
-			}
+			return slots[index] != 0;
 		}
 
-		bool IsOpen() const
+		Address GetKey(int index) const
 		{
-			return socket != 0;
+			const unsigned long long key = slots[index] & KeyMask;
+			return Address((unsigned int)(key >> 16), (unsigned short)(key & 0xFFFF));
 		}
 
-		bool Send(const Address& destination, const void* data, int size)
+		T& GetValue(int index)
 		{
-			assert(data);
-			assert(size > 0);
+			return values[index];
+		}
 
-			if (socket == 0)
-				return false;
+	private:
 
-			assert(destination.GetAddress() != 0);
-			assert(destination.GetPort() != 0);
+		enum { DistanceShift = 48 };
 
-			sockaddr_in address;
-			address.sin_family = AF_INET;
-			address.sin_addr.s_addr = htonl(destination.GetAddress());
-			address.sin_port = htons((unsigned short)destination.GetPort());
+		static const unsigned long long KeyMask = (1ULL << DistanceShift) - 1;
 
-			int sent_bytes = sendto(socket, (const char*)data, size, 0, (sockaddr*)&address, sizeof(sockaddr_in));
+		static int Distance(unsigned long long slot)
+		{
+			return (int)(slot >> DistanceShift) - 1;
+		}
 
-			return sent_bytes == size;
+		void Allocate(int capacity)
+		{
+			assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+			slots.assign(capacity, 0ULL);
+			values.assign(capacity, T());
+			mask = capacity - 1;
 		}
 
-		int Receive(Address& sender, void* data, int size)
+		int FindIndex(unsigned long long key) const
 		{
-			assert(data);
-			assert(size > 0);
+			int index = (int)(hash_address_key(key) & mask);
+			for (int distance = 0; ; ++distance)
+			{
+				const unsigned long long slot = slots[index];
+				if (slot == 0 || Distance(slot) < distance)
+					return -1;
+				if ((slot & KeyMask) == key)
+					return index;
+				index = (index + 1) & mask;
+			}
+		}
 
-			if (socket == 0)
-				return false;
+		// insert a key known not to be present, taking the slot of any entry closer to its home
+
+		void Place(unsigned long long key, T value)
+		{
+			int index = (int)(hash_address_key(key) & mask);
+			int distance = 0;
+			while (true)
+			{
+				const unsigned long long slot = slots[index];
+				if (slot == 0)
+				{
+					slots[index] = key | ((unsigned long long)(distance + 1) << DistanceShift);
+					values[index] = value;
+					return;
+				}
+				if (Distance(slot) < distance)
+				{
+					slots[index] = key | ((unsigned long long)(distance + 1) << DistanceShift);
+					std::swap(values[index], value);
+					key = slot & KeyMask;
+					distance = Distance(slot);
+				}
+				index = (index + 1) & mask;
+				distance++;
+			}
+		}
 
+		void Rehash(int capacity)
+		{
+			std::vector<unsigned long long> oldSlots;
+			std::vector<T> oldValues;
+			oldSlots.swap(slots);
+			oldValues.swap(values);
+			Allocate(capacity);
+			for (size_t i = 0; i < oldSlots.size(); ++i)
+			{
+				if (oldSlots[i] != 0)
+					Place(oldSlots[i] & KeyMask, oldValues[i]);
+			}
+		}
+
+		std::vector<unsigned long long> slots;		// key and probe distance per slot, zero when empty
+		std::vector<T> values;						// value of each used slot
+		int mask;									// capacity - 1, capacity is a power of two
+		int count;
+	};
+
+	// sockets
+
+	inline bool InitializeSockets()
+	{
 #if PLATFORM == PLATFORM_WINDOWS
-			typedef int socklen_t;
+		WSADATA WsaData;
+		return WSAStartup(MAKEWORD(2, 2), &WsaData) == NO_ERROR;
+#else
+		return true;
 #endif
+	}
 
-			sockaddr_in from;
-			socklen_t fromLength = sizeof(from);
+	inline void ShutdownSockets()
+	{
+#if PLATFORM == PLATFORM_WINDOWS
+		WSACleanup();
+#endif
+	}
 
-			int received_bytes = recvfrom(socket, (char*)data, size, 0, (sockaddr*)&from, &fromLength);
+	// datagram descriptor for batched socket io
+	//  + on send: address is the destination, data/size the payload, timestamp the transmit time with SO_TXTIME (zero for now)
+	//  + on receive: data/size describe the buffer, filled in with sender address and bytes received
 
-			if (received_bytes <= 0)
-				return 0;
+	struct Datagram
+	{
+		Address address;
+		void* data;
+		int size;
+		long long timestamp;		// kernel receive time in nanoseconds, zero if not available (on send: transmit time, see monotonic_now)
+	};
 
-			unsigned int address = ntohl(from.sin_addr.s_addr);
-			unsigned short port = ntohs(from.sin_port);
+	// one piece of a datagram for gather sends and scatter receives, like an iovec
+	//  + each layer contributes its header as a segment of its own, so the payload is never copied to prepend one
 
-			sender = Address(address, port);
+	struct Segment
+	{
+		void* data;
+		int size;
+	};
 
-			return received_bytes;
+	inline int segments_size(const Segment segments[], int count)
+	{
+		int size = 0;
+		for (int i = 0; i < count; ++i)
+			size += segments[i].size;
+		return size;
+	}
+
+	// copy the segments back to back into buffer, returns the bytes copied
+
+	inline int gather_segments(unsigned char* buffer, const Segment segments[], int count)
+	{
+		int offset = 0;
+		for (int i = 0; i < count; ++i)
+		{
+			std::memcpy(buffer + offset, segments[i].data, segments[i].size);
+			offset += segments[i].size;
 		}
+		return offset;
+	}
 
-	private:
+	// spread size bytes of data over the segments in order, returns the bytes that fit
 
-		int socket;
+	inline int scatter_segments(const unsigned char* data, int size, const Segment segments[], int count)
+	{
+		int offset = 0;
+		for (int i = 0; i < count && offset < size; ++i)
+		{
+			const int bytes = size - offset < segments[i].size ? size - offset : segments[i].size;
+			std::memcpy(segments[i].data, data + offset, bytes);
+			offset += bytes;
+		}
+		return offset;
+	}
+
+	// packet received into a PacketPool buffer, hand it back with PacketPool::Release when done
+
+	struct PooledPacket
+	{
+		unsigned char* data;		// payload, at the start of the pool buffer
+		int size;					// payload bytes
+		int index;					// pool buffer holding the payload, -1 if none
 	};
 
-	// connection
+	// fixed set of equally sized packet buffers, acquired and released without locks or allocation
+	//  + buffers are cache line aligned and padded to whole cache lines, so neighbours never share a line
+	//  + the free list is a lock free stack of buffer indices with a version tag against ABA,
+	//    any thread may acquire or release, e.g. a worker releasing what the network thread received
 
-	class Connection
+	class PacketPool
 	{
 	public:
 
-		enum Mode
+		PacketPool(int count, int bufferSize)
+			: next(count)
 		{
-			None,
-			Client,
-			Server
-		};
+			assert(count > 0);
+			assert(bufferSize > 0);
+			this->count = count;
+			this->bufferSize = bufferSize;
+			stride = (bufferSize + CacheLineSize - 1) / CacheLineSize * CacheLineSize;
+			memory.resize((size_t)count * stride + CacheLineSize);
+			const size_t misalignment = (size_t)&memory[0] % CacheLineSize;
+			buffers = &memory[0] + (misalignment ? CacheLineSize - misalignment : 0);
+			for (int i = 0; i < count; ++i)
+				next[i].store(i + 1 < count ? i + 1 : -1, std::memory_order_relaxed);
+			head.store(MakeHead(0, 0), std::memory_order_relaxed);
+			available.store(count, std::memory_order_relaxed);
+		}
 
-		Connection(unsigned int protocolId, float timeout)
+		// index of a free buffer, -1 when all are in use
+
+		int Acquire()
 		{
-			this->protocolId = protocolId;
-			this->timeout = timeout;
-			mode = None;
-			running = false;
-			ClearData();
+			unsigned long long current = head.load(std::memory_order_acquire);
+			while (true)
+			{
+				const int index = HeadIndex(current);
+				if (index < 0)
+					return -1;
+				const int following = next[index].load(std::memory_order_relaxed);
+				if (head.compare_exchange_weak(current, MakeHead(following, HeadTag(current) + 1), std::memory_order_acquire, std::memory_order_acquire))
+				{
+					available.fetch_sub(1, std::memory_order_relaxed);
+					return index;
+				}
+			}
 		}
 
-		virtual ~Connection()
+		void Release(int index)
 		{
-			if (IsRunning())
-				Stop();
+			assert(index >= 0 && index < count);
+			unsigned long long current = head.load(std::memory_order_relaxed);
+			while (true)
+			{
+				next[index].store(HeadIndex(current), std::memory_order_relaxed);
+				if (head.compare_exchange_weak(current, MakeHead(index, HeadTag(current) + 1), std::memory_order_release, std::memory_order_relaxed))
+					break;
+			}
+			available.fetch_add(1, std::memory_order_relaxed);
 		}
 
-		bool Start(int port)
+		void Release(PooledPacket& packet)
 		{
-			assert(!running);
-			printf("start connection on port %d\n", port);
-			if (!socket.Open(port))
-				return false;
-			running = true;
-			OnStart();
-			return true;
+			if (packet.index >= 0)
+				Release(packet.index);
+			packet.data = NULL;
+			packet.size = 0;
+			packet.index = -1;
 		}
 
-		void Stop()
+		unsigned char* GetBuffer(int index) const
 		{
-			assert(running);
-			printf("stop connection\n");
-			bool connected = IsConnected();
-			ClearData();
-			socket.Close();
-			running = false;
-			if (connected)
-				OnDisconnect();
-			OnStop();
+			assert(index >= 0 && index < count);
+			return buffers + (size_t)index * stride;
 		}
 
-		bool IsRunning() const
+		int GetBufferSize() const
 		{
-			return running;
+			return bufferSize;
 		}
 
-		void Listen()
+		int GetCount() const
+		{
+			return count;
+		}
+
+		// free buffers, a snapshot while other threads use the pool
+
+		int GetAvailable() const
+		{
+			return available.load(std::memory_order_relaxed);
+		}
+
+	private:
+
+		PacketPool(const PacketPool& other);
+		PacketPool& operator = (const PacketPool& other);
+
+		// head of the free list: index + 1 in the low 32 bits (zero when empty), version tag in the high 32 bits
+
+		static unsigned long long MakeHead(int index, unsigned int tag)
+		{
+			return ((unsigned long long)tag << 32) | (unsigned int)(index + 1);
+		}
+
+		static int HeadIndex(unsigned long long head)
+		{
+			return (int)(head & 0xFFFFFFFF) - 1;
+		}
+
+		static unsigned int HeadTag(unsigned long long head)
+		{
+			return (unsigned int)(head >> 32);
+		}
+
+		alignas(CacheLineSize) std::atomic<unsigned long long> head;	// top of the free list, on a line of its own
+		alignas(CacheLineSize) std::atomic<int> available;
+		std::vector<std::atomic<int> > next;	// free list link per buffer, -1 at the end
+		std::vector<unsigned char> memory;		// all buffers, plus slack to align them
+		unsigned char* buffers;					// first cache line aligned buffer in memory
+		int count;
+		int bufferSize;
+		int stride;								// bytes from one buffer to the next, whole cache lines
+	};
+
+	// datagram transport underneath a connection: a real udp socket, or a simulated link (see SimulatedNetwork)
+	//  + batch calls default to looping over single sends and receives
+	//  + segment calls default to staging the datagram in a buffer, Socket passes the segments to the kernel
+
+	class Transport
+	{
+	public:
+
+		virtual ~Transport() {}
+
+		virtual bool Open(unsigned short port, bool shared = false) = 0;
+		virtual void Close() = 0;
+		virtual bool IsOpen() const = 0;
+
+		virtual bool Send(const Address& destination, const void* data, int size) = 0;
+		virtual int Receive(Address& sender, void* data, int size) = 0;
+
+		// restrict the transport to a single peer, see Socket::Connect
+
+		virtual bool Connect(const Address& destination) = 0;
+		virtual void Disconnect() = 0;
+
+		virtual int SendBatch(const Datagram datagrams[], int count)
+		{
+			int sent = 0;
+			while (sent < count && Send(datagrams[sent].address, datagrams[sent].data, datagrams[sent].size))
+				sent++;
+			return sent;
+		}
+
+		virtual int ReceiveBatch(Datagram datagrams[], int count)
+		{
+			int received = 0;
+			while (received < count)
+			{
+				int bytes_read = Receive(datagrams[received].address, datagrams[received].data, datagrams[received].size);
+				if (bytes_read <= 0)
+					break;
+				datagrams[received].size = bytes_read;
+				datagrams[received].timestamp = GetReceiveTime();
+				received++;
+			}
+			return received;
+		}
+
+		// gather send: the segments go out back to back as one datagram
+
+		virtual bool SendSegments(const Address& destination, const Segment segments[], int count)
+		{
+			assert(count > 0 && count <= MaxSegments);
+			const int size = segments_size(segments, count);
+			if ((int)segmentBuffer.size() < size)
+				segmentBuffer.resize(size);
+			gather_segments(&segmentBuffer[0], segments, count);
+			return Send(destination, &segmentBuffer[0], size);
+		}
+
+		// scatter receive: the datagram fills the segments in order, returns the bytes received (at most their total)
+
+		virtual int ReceiveSegments(Address& sender, const Segment segments[], int count)
+		{
+			assert(count > 0 && count <= MaxSegments);
+			const int size = segments_size(segments, count);
+			if ((int)segmentBuffer.size() < size)
+				segmentBuffer.resize(size);
+			int bytes_read = Receive(sender, &segmentBuffer[0], size);
+			if (bytes_read <= 0)
+				return 0;
+			return scatter_segments(&segmentBuffer[0], bytes_read, segments, count);
+		}
+
+		// receive time in nanoseconds (see timestamp_now) of the datagram last received, zero if unknown
+
+		virtual long long GetReceiveTime() const
+		{
+			return 0;
+		}
+
+		// handle to wait on for incoming data, -1 if the transport cannot be waited on
+
+		virtual int GetHandle() const
+		{
+			return -1;
+		}
+
+	protected:
+
+		std::vector<unsigned char> segmentBuffer;	// staging for the default segment calls
+	};
+
+#if defined(NET_IO_URING) && defined(__linux__)
+
+	// io_uring backend for socket io (compile with NET_IO_URING, linux 6.0+)
+	//  + receives run as a single multishot recvmsg over a ring of kernel-provided buffers,
+	//    so harvesting a datagram is a read from shared memory rather than a syscall
+	//  + sends are queued into pre-allocated slots and submitted together with one io_uring_enter
+	//  + talks to the kernel through raw syscalls so the header keeps no library dependency
+
+	class IoRing
+	{
+	public:
+
+		IoRing()
+		{
+			fd = -1;
+			socket = 0;
+			sqRing = NULL;
+			cqRing = NULL;
+			sqes = NULL;
+			bufferRing = NULL;
+			buffers = NULL;
+			slotData = NULL;
+			receiveBufferSize = 0;
+			sendSlotSize = 0;
+			sqRingSize = 0;
+			cqRingSize = 0;
+			pending = 0;
+			armed = false;
+			readyHead = 0;
+			readyTail = 0;
+			send_errors = 0;
+			truncated = 0;
+		}
+
+		~IoRing()
+		{
+			Destroy();
+		}
+
+		// maxPacketSize is the largest datagram sent or received, it sizes the send slots and provided buffers
+
+		bool Create(int socket, int maxPacketSize)
+		{
+			assert(fd < 0);
+			assert(maxPacketSize > 0 && maxPacketSize <= MaxOffloadSize);
+
+			this->socket = socket;
+
+			// a provided buffer holds the recvmsg header and source address ahead of the payload
+			receiveBufferSize = (int)(sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_in)) + maxPacketSize;
+			receiveBufferSize = (receiveBufferSize + 63) & ~63;
+			sendSlotSize = maxPacketSize;
+
+			io_uring_params params;
+			memset(&params, 0, sizeof(params));
+			params.flags = IORING_SETUP_CQSIZE;
+			params.cq_entries = CompletionEntries;
+
+			fd = (int)syscall(__NR_io_uring_setup, SubmissionEntries, &params);
+			if (fd < 0)
+				return false;
+
+			sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+			cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+			const bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+			if (single && cqRingSize > sqRingSize)
+				sqRingSize = cqRingSize;
+
+			sqRing = (unsigned char*)mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+			if (sqRing == MAP_FAILED)
+			{
+				sqRing = NULL;
+				Destroy();
+				return false;
+			}
+
+			if (single)
+				cqRing = sqRing;
+			else
+			{
+				cqRing = (unsigned char*)mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+				if (cqRing == MAP_FAILED)
+				{
+					cqRing = NULL;
+					Destroy();
+					return false;
+				}
+			}
+
+			sqes = (io_uring_sqe*)mmap(NULL, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+			if (sqes == MAP_FAILED)
+			{
+				sqes = NULL;
+				Destroy();
+				return false;
+			}
+			sqEntries = params.sq_entries;
+
+			sqHead = (unsigned int*)(sqRing + params.sq_off.head);
+			sqTail = (unsigned int*)(sqRing + params.sq_off.tail);
+			sqMask = *(unsigned int*)(sqRing + params.sq_off.ring_mask);
+			sqArray = (unsigned int*)(sqRing + params.sq_off.array);
+			cqHead = (unsigned int*)(cqRing + params.cq_off.head);
+			cqTail = (unsigned int*)(cqRing + params.cq_off.tail);
+			cqMask = *(unsigned int*)(cqRing + params.cq_off.ring_mask);
+			cqes = (io_uring_cqe*)(cqRing + params.cq_off.cqes);
+
+			// register the provided buffer ring that multishot receives draw from
+
+			bufferRing = (io_uring_buf_ring*)mmap(NULL, ReceiveBuffers * sizeof(io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (bufferRing == MAP_FAILED)
+			{
+				bufferRing = NULL;
+				Destroy();
+				return false;
+			}
+
+			io_uring_buf_reg reg;
+			memset(&reg, 0, sizeof(reg));
+			reg.ring_addr = (unsigned long long)bufferRing;
+			reg.ring_entries = ReceiveBuffers;
+			reg.bgid = BufferGroup;
+			if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+			{
+				Destroy();
+				return false;
+			}
+
+			buffers = new unsigned char[ReceiveBuffers * receiveBufferSize];
+			bufferTail = 0;
+			for (int i = 0; i < ReceiveBuffers; ++i)
+				RecycleBuffer(i);
+
+			slotData = new unsigned char[SendSlots * sendSlotSize];
+			for (int i = 0; i < SendSlots; ++i)
+			{
+				slots[i].busy = false;
+				slots[i].data = slotData + i * sendSlotSize;
+			}
+
+			memset(&receiveHeader, 0, sizeof(receiveHeader));
+			receiveHeader.msg_namelen = sizeof(sockaddr_in);
+
+			Arm();
+			return Submit();
+		}
+
+		void Destroy()
+		{
+			if (buffers)
+			{
+				delete[] buffers;
+				buffers = NULL;
+			}
+			if (slotData)
+			{
+				delete[] slotData;
+				slotData = NULL;
+			}
+			if (bufferRing)
+			{
+				munmap(bufferRing, ReceiveBuffers * sizeof(io_uring_buf));
+				bufferRing = NULL;
+			}
+			if (sqes)
+			{
+				munmap(sqes, sqEntries * sizeof(io_uring_sqe));
+				sqes = NULL;
+			}
+			if (cqRing && cqRing != sqRing)
+				munmap(cqRing, cqRingSize);
+			cqRing = NULL;
+			if (sqRing)
+			{
+				munmap(sqRing, sqRingSize);
+				sqRing = NULL;
+			}
+			if (fd >= 0)
+			{
+				close(fd);
+				fd = -1;
+			}
+			armed = false;
+		}
+
+		// queue a datagram for sending, call Submit to hand queued sends to the kernel
+
+		bool Send(const sockaddr_in& address, const void* data, int size)
+		{
+			assert(size <= sendSlotSize);
+			if (size > sendSlotSize)
+				return false;
+
+			int slot = FreeSlot();
+			if (slot < 0)
+				return false;
+
+			SendSlot& s = slots[slot];
+			s.busy = true;
+			s.address = address;
+			memcpy(s.data, data, size);
+			s.vector.iov_base = s.data;
+			s.vector.iov_len = size;
+			memset(&s.header, 0, sizeof(s.header));
+			s.header.msg_name = &s.address;
+			s.header.msg_namelen = sizeof(sockaddr_in);
+			s.header.msg_iov = &s.vector;
+			s.header.msg_iovlen = 1;
+
+			io_uring_sqe* sqe = NextSqe();
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->fd = socket;
+			sqe->addr = (unsigned long long)&s.header;
+			sqe->len = 1;
+			sqe->user_data = SendTag | (unsigned long long)slot;
+			return true;
+		}
+
+		bool Submit()
+		{
+			if (pending == 0)
+				return true;
+			int result = (int)syscall(__NR_io_uring_enter, fd, pending, 0, 0, NULL, 0);
+			if (result < 0)
+				return false;
+			pending -= result;
+			return true;
+		}
+
+		// copy the next received datagram into data, returns 0 when nothing is ready (never blocks)
+		//  + datagrams longer than the provided buffer arrive truncated (MSG_TRUNC), they are dropped and counted
+
+		int Receive(sockaddr_in& from, void* data, int size)
+		{
+			Reap();
+
+			while (readyHead != readyTail)
+			{
+				const int id = readyQueue[readyHead % ReceiveBuffers];
+				readyHead++;
+
+				const unsigned char* buffer = buffers + id * receiveBufferSize;
+				const io_uring_recvmsg_out* out = (const io_uring_recvmsg_out*)buffer;
+				const unsigned char* name = buffer + sizeof(io_uring_recvmsg_out);
+				const unsigned char* payload = name + receiveHeader.msg_namelen + receiveHeader.msg_controllen;
+
+				if (out->flags & MSG_TRUNC)
+				{
+					truncated++;
+					RecycleBuffer(id);
+					continue;
+				}
+
+				// payloadlen is the datagram length, never copy past the end of the provided buffer
+				int bytes = (int)out->payloadlen;
+				const int available = receiveBufferSize - (int)(payload - buffer);
+				if (bytes > available)
+					bytes = available;
+				if (bytes > size)
+					bytes = size;
+				if (out->namelen >= sizeof(sockaddr_in))
+					memcpy(&from, name, sizeof(sockaddr_in));
+				memcpy(data, payload, bytes);
+
+				RecycleBuffer(id);
+
+				return bytes;
+			}
+
+			if (!armed)
+			{
+				Arm();
+				Submit();
+			}
+			return 0;
+		}
+
+		unsigned int GetSendErrors() const
+		{
+			return send_errors;
+		}
+
+		unsigned int GetTruncatedPackets() const
+		{
+			return truncated;
+		}
+
+		int GetHandle() const
+		{
+			return fd;
+		}
+
+	private:
+
+		enum
+		{
+			SubmissionEntries = 256,
+			CompletionEntries = 1024,
+			ReceiveBuffers = 256,			// power of two, required by the provided buffer ring
+			SendSlots = MaxPacketBatch,
+			BufferGroup = 0
+		};
+
+		static const unsigned long long ReceiveTag = 1ULL << 62;
+		static const unsigned long long SendTag = 1ULL << 63;
+
+		struct SendSlot
+		{
+			bool busy;
+			sockaddr_in address;
+			iovec vector;
+			msghdr header;
+			unsigned char* data;			// sendSlotSize bytes in slotData
+		};
+
+		io_uring_sqe* NextSqe()
+		{
+			unsigned int tail = *sqTail;
+			unsigned int index = tail & sqMask;
+			io_uring_sqe* sqe = &sqes[index];
+			memset(sqe, 0, sizeof(io_uring_sqe));
+			sqArray[index] = index;
+			__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+			pending++;
+			return sqe;
+		}
+
+		void Arm()
+		{
+			io_uring_sqe* sqe = NextSqe();
+			sqe->opcode = IORING_OP_RECVMSG;
+			sqe->fd = socket;
+			sqe->addr = (unsigned long long)&receiveHeader;
+			sqe->len = 1;
+			sqe->ioprio = IORING_RECV_MULTISHOT;
+			sqe->flags = IOSQE_BUFFER_SELECT;
+			sqe->buf_group = BufferGroup;
+			sqe->user_data = ReceiveTag;
+			armed = true;
+		}
+
+		void RecycleBuffer(int id)
+		{
+			// note: index the entries directly, in C++ the header's flex array member is not at offset zero
+			io_uring_buf& buf = ((io_uring_buf*)bufferRing)[bufferTail & (ReceiveBuffers - 1)];
+			buf.addr = (unsigned long long)(buffers + id * receiveBufferSize);
+			buf.len = receiveBufferSize;
+			buf.bid = (unsigned short)id;
+			bufferTail++;
+			__atomic_store_n(&bufferRing->tail, bufferTail, __ATOMIC_RELEASE);
+		}
+
+		// drain the completion queue: free finished send slots and queue received buffers
+
+		void Reap()
+		{
+			unsigned int head = *cqHead;
+			const unsigned int tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+			while (head != tail)
+			{
+				const io_uring_cqe& cqe = cqes[head & cqMask];
+				if (cqe.user_data & SendTag)
+				{
+					slots[cqe.user_data & ~SendTag].busy = false;
+					if (cqe.res < 0)
+						send_errors++;
+				}
+				else
+				{
+					if (cqe.flags & IORING_CQE_F_BUFFER)
+					{
+						int id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+						if (cqe.res > 0)
+						{
+							readyQueue[readyTail % ReceiveBuffers] = id;
+							readyTail++;
+						}
+						else
+							RecycleBuffer(id);
+					}
+					if (!(cqe.flags & IORING_CQE_F_MORE))
+						armed = false;
+				}
+				head++;
+			}
+			__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+		}
+
+		int FreeSlot()
+		{
+			for (int attempt = 0; attempt < 2; ++attempt)
+			{
+				for (int i = 0; i < SendSlots; ++i)
+					if (!slots[i].busy)
+						return i;
+				// every slot is in flight: flush queued sends and wait for one to complete
+				int result = (int)syscall(__NR_io_uring_enter, fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+				if (result > 0)
+					pending -= result;
+				Reap();
+			}
+			return -1;
+		}
+
+		int fd;
+		int socket;
+
+		unsigned char* sqRing;
+		unsigned char* cqRing;
+		size_t sqRingSize;
+		size_t cqRingSize;
+		io_uring_sqe* sqes;
+		unsigned int sqEntries;
+		unsigned int* sqHead;
+		unsigned int* sqTail;
+		unsigned int sqMask;
+		unsigned int* sqArray;
+		unsigned int* cqHead;
+		unsigned int* cqTail;
+		unsigned int cqMask;
+		io_uring_cqe* cqes;
+		unsigned int pending;				// sqes queued but not yet submitted
+
+		io_uring_buf_ring* bufferRing;		// provided buffer ring shared with the kernel
+		unsigned char* buffers;				// backing storage for the provided buffers
+		int receiveBufferSize;				// bytes per provided buffer: recvmsg header, address and payload
+		unsigned short bufferTail;
+		msghdr receiveHeader;				// template for the multishot recvmsg (name length only)
+		bool armed;							// multishot receive is live in the kernel
+
+		int readyQueue[ReceiveBuffers];		// ids of received buffers not yet consumed by Receive
+		unsigned int readyHead;
+		unsigned int readyTail;
+
+		SendSlot slots[SendSlots];
+		unsigned char* slotData;			// backing storage for the send slots
+		int sendSlotSize;					// largest datagram a send slot holds
+		unsigned int send_errors;
+		unsigned int truncated;				// datagrams dropped for not fitting a provided buffer
+	};
+
+#endif
+
+	class Socket : public Transport
+	{
+	public:
+
+		Socket()
+		{
+			socket = 0;
+			offload = false;
+			peer = Address();
+			drop_accounting = false;
+			dropped_packets = 0;
+			timestamps = false;
+			receive_time = 0;
+			zerocopy = false;
+			zerocopy_next = 0;
+			zerocopy_completed = 0;
+			zerocopy_copied = 0;
+			txtime = false;
+			pacing_rate = 0;
+#if defined(NET_IO_URING) && defined(__linux__)
+			ring = NULL;
+#endif
+		}
+
+		~Socket()
+		{
+			Close();
+		}
+
+		bool Open(unsigned short port, bool shared = false)
+		{
+			assert(!IsOpen());
+
+			// create socket
+
+			socket = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+			if (socket <= 0)
+			{
+				printf("failed to create socket\n");
+				socket = 0;
+				return false;
+			}
+
+			// share the port with other sockets (SO_REUSEPORT), the kernel hashes each flow to one of them
+
+			if (shared)
+			{
+#if (PLATFORM == PLATFORM_MAC || PLATFORM == PLATFORM_UNIX) && defined(SO_REUSEPORT)
+				int reuse = 1;
+				if (setsockopt(socket, SOL_SOCKET, SO_REUSEPORT, (const char*)&reuse, sizeof(reuse)) != 0)
+				{
+					printf("failed to share port\n");
+					Close();
+					return false;
+				}
+#else
+				printf("port sharing not supported\n");
+				Close();
+				return false;
+#endif
+			}
+
+			// bind to port
+
+			sockaddr_in address;
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = INADDR_ANY;
+			address.sin_port = htons((unsigned short)port);
+
+			if (::bind(socket, (const sockaddr*)&address, sizeof(sockaddr_in)) < 0)
+			{
+				printf("failed to bind socket\n");
+				Close();
+				return false;
+			}
+
+			// set non-blocking io
+
+#if PLATFORM == PLATFORM_MAC || PLATFORM == PLATFORM_UNIX
+
+			int nonBlocking = 1;
+			if (fcntl(socket, F_SETFL, O_NONBLOCK, nonBlocking) == -1)
+			{
+				printf("failed to set non-blocking socket\n");
+				Close();
+				return false;
+			}
+
+#elif PLATFORM == PLATFORM_WINDOWS
+
+			DWORD nonBlocking = 1;
+			if (ioctlsocket(socket, FIONBIO, &nonBlocking) != 0)
+			{
+				printf("failed to set non-blocking socket\n");
+				Close();
+				return false;
+			}
+
+#endif
+
+			return true;
+		}
+
+		void Close()
+		{
+#if defined(NET_IO_URING) && defined(__linux__)
+			if (ring)
+			{
+				delete ring;
+				ring = NULL;
+			}
+#endif
+			if (socket != 0)
+			{
+#if PLATFORM == PLATFORM_MAC || PLATFORM == PLATFORM_UNIX
+				close(socket);
+#elif PLATFORM == PLATFORM_WINDOWS
+				closesocket(socket);
+#endif
+				socket = 0;
+			}
+			offload = false;
+			peer = Address();
+			drop_accounting = false;
+			dropped_packets = 0;
+			timestamps = false;
+			receive_time = 0;
+			zerocopy = false;
+			zerocopy_next = 0;
+			zerocopy_completed = 0;
+			zerocopy_copied = 0;
+			zerocopy_done.clear();
+			txtime = false;
+			pacing_rate = 0;
+		}
+
+		bool IsOpen() const
+		{
+			return socket != 0;
+		}
+
+		// kernel socket buffer sizes in bytes, size them for the bandwidth-delay product of the path
+		//  + the kernel may round or double the request, use the getters to read back the actual size
+
+		bool SetBufferSizes(int receiveSize, int sendSize)
+		{
+			assert(IsOpen());
+			assert(receiveSize > 0);
+			assert(sendSize > 0);
+
+			if (setsockopt(socket, SOL_SOCKET, SO_RCVBUF, (const char*)&receiveSize, sizeof(receiveSize)) != 0 ||
+				setsockopt(socket, SOL_SOCKET, SO_SNDBUF, (const char*)&sendSize, sizeof(sendSize)) != 0)
+			{
+				printf("failed to set socket buffer sizes\n");
+				return false;
+			}
+			return true;
+		}
+
+		int GetReceiveBufferSize() const
+		{
+			return GetBufferSize(SO_RCVBUF);
+		}
+
+		int GetSendBufferSize() const
+		{
+			return GetBufferSize(SO_SNDBUF);
+		}
+
+		// count datagrams the kernel dropped because our receive queue was full (SO_RXQ_OVFL)
+		//  + the kernel stamps the running count on each datagram it queues, so drops show up once the next packet is read
+		//  + not tracked while the io_uring backend is enabled
+
+		bool EnableDropAccounting()
+		{
+			assert(IsOpen());
+#if defined(__linux__)
+			int enable = 1;
+			if (setsockopt(socket, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable)) != 0)
+			{
+				printf("receive queue drop accounting not supported\n");
+				return false;
+			}
+			drop_accounting = true;
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		unsigned int GetDroppedPackets() const
+		{
+			return dropped_packets;
+		}
+
+		// kernel receive timestamps (SO_TIMESTAMPNS): the time each datagram reached the socket,
+		// independent of when the application got around to reading it
+		//  + not available while the io_uring backend is enabled
+
+		bool EnableTimestamps()
+		{
+			assert(IsOpen());
+#if defined(__linux__)
+			int enable = 1;
+			if (setsockopt(socket, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) != 0)
+			{
+				printf("receive timestamps not supported\n");
+				return false;
+			}
+			timestamps = true;
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		// receive time in nanoseconds (see timestamp_now) of the datagram last returned by Receive or ReceiveSegmented, zero if unknown
+
+		long long GetReceiveTime() const
+		{
+			return receive_time;
+		}
+
+		// zero copy sends (MSG_ZEROCOPY): the kernel pins the caller's pages instead of copying them
+		//  + each send is numbered, and the buffers must stay untouched until PollCompletions reports it done
+		//  + only pays off for large payloads, page pinning costs more than a memcpy below ~10KB
+		//  + not available while the io_uring backend is enabled
+
+		bool EnableZeroCopy()
+		{
+			assert(IsOpen());
+#if defined(__linux__)
+			if (IsRingEnabled())
+				return false;
+			int enable = 1;
+			if (setsockopt(socket, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) != 0)
+			{
+				printf("zero copy send not supported\n");
+				return false;
+			}
+			zerocopy = true;
+			zerocopy_done.assign(MaxZeroCopyInFlight, 0);
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		bool IsZeroCopyEnabled() const
+		{
+			return zerocopy;
+		}
+
+		// id the next zero copy send will be given
+
+		unsigned int GetNextZeroCopyId() const
+		{
+			return zerocopy_next;
+		}
+
+		// send header followed by data as one datagram without copying either, id receives the send number
+		//  + fails without sending when MaxZeroCopyInFlight sends are still waiting for completion
+
+		bool SendZeroCopy(const Address& destination, const void* header, int headerSize, const void* data, int size, unsigned int& id)
+		{
+			assert(header);
+			assert(headerSize > 0);
+			assert(data);
+			assert(size > 0);
+
+			if (socket == 0 || !zerocopy)
+				return false;
+
+#if defined(__linux__)
+
+			if (zerocopy_next - zerocopy_completed >= (unsigned int)MaxZeroCopyInFlight)
+				return false;
+
+			assert(destination.GetAddress() != 0);
+			assert(destination.GetPort() != 0);
+
+			sockaddr_in address;
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = htonl(destination.GetAddress());
+			address.sin_port = htons((unsigned short)destination.GetPort());
+
+			iovec vectors[2];
+			vectors[0].iov_base = (void*)header;
+			vectors[0].iov_len = headerSize;
+			vectors[1].iov_base = (void*)data;
+			vectors[1].iov_len = size;
+
+			msghdr message;
+			memset(&message, 0, sizeof(message));
+			if (destination != peer)
+			{
+				message.msg_name = &address;
+				message.msg_namelen = sizeof(sockaddr_in);
+			}
+			message.msg_iov = vectors;
+			message.msg_iovlen = 2;
+
+			// the kernel numbers successful zero copy sends from zero, a failed send does not use up a number
+			int sent_bytes = sendmsg(socket, &message, MSG_ZEROCOPY);
+
+			if (sent_bytes != headerSize + size)
+				return false;
+
+			id = zerocopy_next++;
+			return true;
+
+#else
+
+			return false;
+
+#endif
+		}
+
+		// read completion notifications off the socket error queue, returns the number of sends newly completed
+		//  + completions arrive as ranges of send ids and may be out of order, ids are retired in order
+
+		int PollCompletions()
+		{
+			if (socket == 0 || !zerocopy)
+				return 0;
+
+			int completed = 0;
+
+#if defined(__linux__)
+
+			while (true)
+			{
+				char control[ControlBufferSize];
+
+				msghdr message;
+				memset(&message, 0, sizeof(message));
+				message.msg_control = control;
+				message.msg_controllen = sizeof(control);
+
+				if (recvmsg(socket, &message, MSG_ERRQUEUE) < 0)
+					break;
+
+				for (cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg))
+				{
+					if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR)
+						continue;
+					sock_extended_err error;
+					memcpy(&error, CMSG_DATA(cmsg), sizeof(error));
+					if (error.ee_errno != 0 || error.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+						continue;
+					const unsigned int first = error.ee_info;
+					const unsigned int last = error.ee_data;
+					for (unsigned int id = first; id - first <= last - first; ++id)
+						zerocopy_done[id % MaxZeroCopyInFlight] = 1;
+					// the kernel fell back to copying (e.g. loopback, or a device without scatter/gather)
+					if (error.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+						zerocopy_copied += last - first + 1;
+				}
+			}
+
+			while (zerocopy_completed != zerocopy_next && zerocopy_done[zerocopy_completed % MaxZeroCopyInFlight])
+			{
+				zerocopy_done[zerocopy_completed % MaxZeroCopyInFlight] = 0;
+				zerocopy_completed++;
+				completed++;
+			}
+
+#endif
+
+			return completed;
+		}
+
+		// true once the kernel no longer references the buffers of send id (as of the last PollCompletions)
+
+		bool IsSendComplete(unsigned int id) const
+		{
+			return (int)(zerocopy_completed - id) > 0;
+		}
+
+		// zero copy sends the kernel ended up copying anyway
+
+		unsigned int GetCopiedSends() const
+		{
+			return zerocopy_copied;
+		}
+
+		// busy polling (SO_BUSY_POLL): receives spin on the device queue for up to the given time instead of
+		// waiting for the interrupt, trading cpu for latency
+		//  + raising it above the net.core.busy_read default needs CAP_NET_ADMIN
+
+		bool EnableBusyPoll(int microseconds)
+		{
+			assert(IsOpen());
+			assert(microseconds > 0);
+#if defined(__linux__)
+			if (setsockopt(socket, SOL_SOCKET, SO_BUSY_POLL, &microseconds, sizeof(microseconds)) != 0)
+			{
+				printf("socket busy polling not supported\n");
+				return false;
+			}
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		// kernel pacing (SO_MAX_PACING_RATE): the fq qdisc spreads this socket's datagrams out to at most
+		// bytesPerSecond instead of letting each burst hit the wire back to back, zero removes the limit
+		//  + needs the fq qdisc on the egress device, elsewhere the rate is accepted and ignored
+
+		bool SetPacingRate(int bytesPerSecond)
+		{
+			assert(IsOpen());
+			assert(bytesPerSecond >= 0);
+#if defined(__linux__)
+			if (bytesPerSecond == pacing_rate)
+				return true;
+			unsigned int rate = bytesPerSecond > 0 ? (unsigned int)bytesPerSecond : ~0U;
+			if (setsockopt(socket, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) != 0)
+			{
+				printf("socket pacing rate not supported\n");
+				return false;
+			}
+			pacing_rate = bytesPerSecond;
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		// transmit times (SO_TXTIME): SendBatch holds each datagram in the qdisc until its Datagram::timestamp
+		//  + times are CLOCK_MONOTONIC nanoseconds (see monotonic_now), honoured by the fq and etf qdiscs
+		//  + not combined with offload or the io_uring backend, which send without per-datagram control data
+
+		bool EnableTxTime()
+		{
+			assert(IsOpen());
+#if defined(__linux__)
+			if (offload || IsRingEnabled())
+				return false;
+			sock_txtime config;
+			memset(&config, 0, sizeof(config));
+			config.clockid = CLOCK_MONOTONIC;
+			if (setsockopt(socket, SOL_SOCKET, SO_TXTIME, &config, sizeof(config)) != 0)
+			{
+				printf("socket transmit times not supported\n");
+				return false;
+			}
+			txtime = true;
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		bool IsTxTimeEnabled() const
+		{
+			return txtime;
+		}
+
+		// path mtu probing: send every datagram with DF set, ignoring the kernel's cached path mtu (IP_PMTUDISC_PROBE)
+		//  + a datagram too big for the path is then lost instead of fragmented, which is what a probe needs to learn
+		//  + datagrams bigger than the local interface mtu fail to send right away
+
+		bool EnablePathMtuProbing()
+		{
+			assert(IsOpen());
+#if defined(__linux__)
+			int probe = IP_PMTUDISC_PROBE;
+			if (setsockopt(socket, IPPROTO_IP, IP_MTU_DISCOVER, &probe, sizeof(probe)) != 0)
+			{
+				printf("path mtu probing not supported\n");
+				return false;
+			}
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		// mtu of the route to the connected peer as known to the kernel (ip packet bytes), zero if unknown
+
+		int GetRouteMtu() const
+		{
+#if defined(__linux__)
+			if (socket == 0 || peer.GetAddress() == 0)
+				return 0;
+			int mtu = 0;
+			socklen_t length = sizeof(mtu);
+			if (getsockopt(socket, IPPROTO_IP, IP_MTU, &mtu, &length) != 0)
+				return 0;
+			return mtu;
+#else
+			return 0;
+#endif
+		}
+
+		// connected mode: fix the socket to a single peer with connect()
+		//  + sends to the peer skip the per-packet address and route lookup, and the kernel drops traffic from anyone else
+
+		bool Connect(const Address& destination)
+		{
+			assert(IsOpen());
+			assert(destination.GetAddress() != 0);
+			assert(destination.GetPort() != 0);
+
+			sockaddr_in address;
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = htonl(destination.GetAddress());
+			address.sin_port = htons((unsigned short)destination.GetPort());
+
+			if (::connect(socket, (const sockaddr*)&address, sizeof(sockaddr_in)) != 0)
+			{
+				printf("failed to connect socket\n");
+				return false;
+			}
+
+			peer = destination;
+			return true;
+		}
+
+		// dissolve the peer association so the socket accepts datagrams from any address again
+
+		void Disconnect()
+		{
+			if (socket == 0 || peer.GetAddress() == 0)
+				return;
+
+			sockaddr_in address;
+			memset(&address, 0, sizeof(address));
+			address.sin_family = AF_UNSPEC;
+			::connect(socket, (const sockaddr*)&address, sizeof(sockaddr_in));
+
+			peer = Address();
+		}
+
+		bool IsConnected() const
+		{
+			return peer.GetAddress() != 0;
+		}
+
+		// segmentation offload: the kernel splits one large send into equally sized datagrams (UDP_SEGMENT)
+		// and coalesces consecutive received datagrams from the same flow into one buffer (UDP_GRO)
+		//  + returns false and leaves offload disabled if the platform or kernel does not support it
+
+		bool EnableOffload()
+		{
+			assert(IsOpen());
+#if defined(__linux__)
+			if (IsRingEnabled() || txtime)
+				return false;
+			int enable = 1;
+			int segment = 0;
+			if (setsockopt(socket, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) != 0 ||
+				setsockopt(socket, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment)) != 0)
+			{
+				printf("udp segmentation offload not supported\n");
+				return false;
+			}
+			offload = true;
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		bool IsOffloadEnabled() const
+		{
+			return offload;
+		}
+
+		// io_uring backend: multishot receive into kernel-provided buffers, batched async sends
+		//  + buffers are sized for maxPacketSize, longer datagrams are dropped on receive and refused on send
+		//  + only available when compiled with NET_IO_URING on linux, and not combined with offload, zero copy or txtime
+
+		bool EnableRing(int maxPacketSize = DefaultMaxPacketSize)
+		{
+			assert(IsOpen());
+#if defined(NET_IO_URING) && defined(__linux__)
+			if (ring || offload || zerocopy || txtime)
+				return false;
+			ring = new IoRing();
+			if (!ring->Create(socket, maxPacketSize))
+			{
+				printf("failed to create io_uring\n");
+				delete ring;
+				ring = NULL;
+				return false;
+			}
+			return true;
+#else
+			(void)maxPacketSize;
+			return false;
+#endif
+		}
+
+		bool IsRingEnabled() const
+		{
+#if defined(NET_IO_URING) && defined(__linux__)
+			return ring != NULL;
+#else
+			return false;
+#endif
+		}
+
+		// handle to wait on for incoming data (the io_uring completion queue when the ring is enabled)
+
+		int GetHandle() const
+		{
+#if defined(NET_IO_URING) && defined(__linux__)
+			if (ring)
+				return ring->GetHandle();
+#endif
+			return socket;
+		}
+
+		bool Send(const Address& destination, const void* data, int size)
+		{
+			assert(data);
+			assert(size > 0);
+
+			if (socket == 0)
+				return false;
+
+			assert(destination.GetAddress() != 0);
+			assert(destination.GetPort() != 0);
+
+			sockaddr_in address;
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = htonl(destination.GetAddress());
+			address.sin_port = htons((unsigned short)destination.GetPort());
+
+#if defined(NET_IO_URING) && defined(__linux__)
+			if (ring)
+				return ring->Send(address, data, size) && ring->Submit();
+#endif
+
+			if (destination == peer)
+			{
+				// connected fast path: the kernel already holds the route and address
+				int sent_bytes = ::send(socket, (const char*)data, size, 0);
+				return sent_bytes == size;
+			}
+
+			int sent_bytes = sendto(socket, (const char*)data, size, 0, (sockaddr*)&address, sizeof(sockaddr_in));
+
+			return sent_bytes == size;
+		}
+
+		int Receive(Address& sender, void* data, int size)
+		{
+			assert(data);
+			assert(size > 0);
+
+			if (socket == 0)
+				return false;
+
+			receive_time = 0;
+
+#if PLATFORM == PLATFORM_WINDOWS
+			typedef int socklen_t;
+#endif
+
+			sockaddr_in from;
+			socklen_t fromLength = sizeof(from);
+
+#if defined(NET_IO_URING) && defined(__linux__)
+			if (ring)
+			{
+				int ring_bytes = ring->Receive(from, data, size);
+				if (ring_bytes <= 0)
+					return 0;
+				sender = Address(ntohl(from.sin_addr.s_addr), ntohs(from.sin_port));
+				return ring_bytes;
+			}
+#endif
+
+#if defined(__linux__)
+			if (drop_accounting || timestamps)
+			{
+				iovec vector;
+				vector.iov_base = data;
+				vector.iov_len = size;
+				return ReceiveMessage(sender, &vector, 1);
+			}
+#endif
+
+			if (peer.GetAddress() != 0)
+			{
+				// connected: the kernel only delivers datagrams from the peer
+				int received_bytes = recv(socket, (char*)data, size, 0);
+				if (received_bytes <= 0)
+					return 0;
+				sender = peer;
+				return received_bytes;
+			}
+
+			int received_bytes = recvfrom(socket, (char*)data, size, 0, (sockaddr*)&from, &fromLength);
+
+			if (received_bytes <= 0)
+				return 0;
+
+			unsigned int address = ntohl(from.sin_addr.s_addr);
+			unsigned short port = ntohs(from.sin_port);
+
+			sender = Address(address, port);
+
+			return received_bytes;
+		}
+
+		// gather send without copying: the segments are the iovec of a single sendmsg
+
+		bool SendSegments(const Address& destination, const Segment segments[], int count)
+		{
+			assert(count > 0 && count <= MaxSegments);
+
+#if PLATFORM != PLATFORM_WINDOWS
+
+			if (socket == 0)
+				return false;
+
+#if defined(NET_IO_URING) && defined(__linux__)
+			if (ring)
+				return Transport::SendSegments(destination, segments, count);
+#endif
+
+			assert(destination.GetAddress() != 0);
+			assert(destination.GetPort() != 0);
+
+			sockaddr_in address;
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = htonl(destination.GetAddress());
+			address.sin_port = htons((unsigned short)destination.GetPort());
+
+			iovec vectors[MaxSegments];
+			for (int i = 0; i < count; ++i)
+			{
+				vectors[i].iov_base = segments[i].data;
+				vectors[i].iov_len = segments[i].size;
+			}
+
+			msghdr message;
+			memset(&message, 0, sizeof(message));
+			if (destination != peer)
+			{
+				message.msg_name = &address;
+				message.msg_namelen = sizeof(sockaddr_in);
+			}
+			message.msg_iov = vectors;
+			message.msg_iovlen = count;
+
+			int sent_bytes = sendmsg(socket, &message, 0);
+
+			return sent_bytes == segments_size(segments, count);
+
+#else
+			return Transport::SendSegments(destination, segments, count);
+#endif
+		}
+
+		// scatter receive without copying: the segments are the iovec of a single recvmsg
+
+		int ReceiveSegments(Address& sender, const Segment segments[], int count)
+		{
+			assert(count > 0 && count <= MaxSegments);
+
+#if PLATFORM != PLATFORM_WINDOWS
+
+			if (socket == 0)
+				return 0;
+
+#if defined(NET_IO_URING) && defined(__linux__)
+			if (ring)
+				return Transport::ReceiveSegments(sender, segments, count);
+#endif
+
+			receive_time = 0;
+
+			iovec vectors[MaxSegments];
+			for (int i = 0; i < count; ++i)
+			{
+				vectors[i].iov_base = segments[i].data;
+				vectors[i].iov_len = segments[i].size;
+			}
+
+#if defined(__linux__)
+			if (drop_accounting || timestamps)
+				return ReceiveMessage(sender, vectors, count);
+#endif
+
+			sockaddr_in from;
+
+			msghdr message;
+			memset(&message, 0, sizeof(message));
+			message.msg_name = &from;
+			message.msg_namelen = sizeof(from);
+			message.msg_iov = vectors;
+			message.msg_iovlen = count;
+
+			int received_bytes = recvmsg(socket, &message, 0);
+
+			if (received_bytes <= 0)
+				return 0;
+
+			sender = Address(ntohl(from.sin_addr.s_addr), ntohs(from.sin_port));
+
+			return received_bytes;
+
+#else
+			return Transport::ReceiveSegments(sender, segments, count);
+#endif
+		}
+
+		// send a burst of datagrams, returns the number sent (stops at the first failure)
+		//  + on linux the whole burst crosses into the kernel with a single sendmmsg call
+
+		int SendBatch(const Datagram datagrams[], int count)
+		{
+			assert(datagrams);
+			assert(count >= 0 && count <= MaxPacketBatch);
+
+			if (socket == 0)
+				return 0;
+
+#if defined(NET_IO_URING) && defined(__linux__)
+
+			if (ring)
+			{
+				int queued = 0;
+				for (; queued < count; ++queued)
+				{
+					sockaddr_in address;
+					address.sin_family = AF_INET;
+					address.sin_addr.s_addr = htonl(datagrams[queued].address.GetAddress());
+					address.sin_port = htons((unsigned short)datagrams[queued].address.GetPort());
+					if (!ring->Send(address, datagrams[queued].data, datagrams[queued].size))
+						break;
+				}
+				return ring->Submit() ? queued : 0;
+			}
+
+#endif
+
+#if defined(__linux__)
+
+			sockaddr_in addresses[MaxPacketBatch];
+			iovec vectors[MaxPacketBatch];
+			mmsghdr messages[MaxPacketBatch];
+			char controls[MaxPacketBatch][CMSG_SPACE(sizeof(unsigned long long))];
+			memset(messages, 0, sizeof(mmsghdr) * count);
+
+			for (int i = 0; i < count; ++i)
+			{
+				assert(datagrams[i].data);
+				assert(datagrams[i].size > 0);
+				assert(datagrams[i].address.GetAddress() != 0);
+				assert(datagrams[i].address.GetPort() != 0);
+
+				addresses[i].sin_family = AF_INET;
+				addresses[i].sin_addr.s_addr = htonl(datagrams[i].address.GetAddress());
+				addresses[i].sin_port = htons((unsigned short)datagrams[i].address.GetPort());
+
+				vectors[i].iov_base = datagrams[i].data;
+				vectors[i].iov_len = datagrams[i].size;
+
+				// datagrams to the connected peer carry no address, the kernel uses the cached one
+				const bool connected = datagrams[i].address == peer;
+				messages[i].msg_hdr.msg_name = connected ? NULL : &addresses[i];
+				messages[i].msg_hdr.msg_namelen = connected ? 0 : sizeof(sockaddr_in);
+				messages[i].msg_hdr.msg_iov = &vectors[i];
+				messages[i].msg_hdr.msg_iovlen = 1;
+
+				if (txtime && datagrams[i].timestamp != 0)
+				{
+					memset(controls[i], 0, sizeof(controls[i]));
+					messages[i].msg_hdr.msg_control = controls[i];
+					messages[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+					cmsghdr* cmsg = CMSG_FIRSTHDR(&messages[i].msg_hdr);
+					cmsg->cmsg_level = SOL_SOCKET;
+					cmsg->cmsg_type = SCM_TXTIME;
+					cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned long long));
+					unsigned long long transmit = (unsigned long long)datagrams[i].timestamp;
+					memcpy(CMSG_DATA(cmsg), &transmit, sizeof(transmit));
+				}
+			}
+
+			int sent = 0;
+			while (sent < count)
+			{
+				int result = sendmmsg(socket, messages + sent, count - sent, 0);
+				if (result <= 0)
+					break;
+				sent += result;
+			}
+			return sent;
+
+#else
+
+			int sent = 0;
+			while (sent < count && Send(datagrams[sent].address, datagrams[sent].data, datagrams[sent].size))
+				sent++;
+			return sent;
+
+#endif
+		}
+
+		// receive up to count pending datagrams without blocking, returns the number received
+		//  + on linux the socket queue is drained with a single recvmmsg call
+
+		int ReceiveBatch(Datagram datagrams[], int count)
+		{
+			assert(datagrams);
+			assert(count >= 0 && count <= MaxPacketBatch);
+
+			if (socket == 0)
+				return 0;
+
+#if defined(__linux__)
+
+			if (!IsRingEnabled())
+			{
+				sockaddr_in addresses[MaxPacketBatch];
+				iovec vectors[MaxPacketBatch];
+				mmsghdr messages[MaxPacketBatch];
+				char controls[MaxPacketBatch][ControlBufferSize];
+				memset(messages, 0, sizeof(mmsghdr) * count);
+
+				for (int i = 0; i < count; ++i)
+				{
+					assert(datagrams[i].data);
+					assert(datagrams[i].size > 0);
+
+					vectors[i].iov_base = datagrams[i].data;
+					vectors[i].iov_len = datagrams[i].size;
+
+					messages[i].msg_hdr.msg_name = &addresses[i];
+					messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+					messages[i].msg_hdr.msg_iov = &vectors[i];
+					messages[i].msg_hdr.msg_iovlen = 1;
+					if (drop_accounting || timestamps)
+					{
+						messages[i].msg_hdr.msg_control = controls[i];
+						messages[i].msg_hdr.msg_controllen = ControlBufferSize;
+					}
+				}
+
+				int received = recvmmsg(socket, messages, count, MSG_DONTWAIT, NULL);
+
+				if (received <= 0)
+					return 0;
+
+				for (int i = 0; i < received; ++i)
+				{
+					datagrams[i].address = Address(ntohl(addresses[i].sin_addr.s_addr), ntohs(addresses[i].sin_port));
+					datagrams[i].size = messages[i].msg_len;
+					datagrams[i].timestamp = ReadControl(messages[i].msg_hdr);
+				}
+
+				return received;
+			}
+
+#endif
+
+			int received = 0;
+			while (received < count)
+			{
+				int bytes_read = Receive(datagrams[received].address, datagrams[received].data, datagrams[received].size);
+				if (bytes_read <= 0)
+					break;
+				datagrams[received].size = bytes_read;
+				datagrams[received].timestamp = receive_time;
+				received++;
+			}
+			return received;
+		}
+
+		// send a super-buffer as consecutive datagrams of segmentSize bytes (the last may be shorter)
+		//  + with offload enabled this is a single sendmsg, otherwise one send per segment
+
+		bool SendSegmented(const Address& destination, const void* data, int size, int segmentSize)
+		{
+			assert(data);
+			assert(size > 0);
+			assert(segmentSize > 0);
+
+			if (socket == 0)
+				return false;
+
+#if defined(__linux__)
+
+			if (offload && size > segmentSize)
+			{
+				assert(destination.GetAddress() != 0);
+				assert(destination.GetPort() != 0);
+
+				sockaddr_in address;
+				address.sin_family = AF_INET;
+				address.sin_addr.s_addr = htonl(destination.GetAddress());
+				address.sin_port = htons((unsigned short)destination.GetPort());
+
+				iovec vector;
+				vector.iov_base = (void*)data;
+				vector.iov_len = size;
+
+				char control[CMSG_SPACE(sizeof(unsigned short))];
+				memset(control, 0, sizeof(control));
+
+				msghdr message;
+				memset(&message, 0, sizeof(message));
+				if (destination != peer)
+				{
+					message.msg_name = &address;
+					message.msg_namelen = sizeof(sockaddr_in);
+				}
+				message.msg_iov = &vector;
+				message.msg_iovlen = 1;
+				message.msg_control = control;
+				message.msg_controllen = sizeof(control);
+
+				cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+				cmsg->cmsg_level = SOL_UDP;
+				cmsg->cmsg_type = UDP_SEGMENT;
+				cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned short));
+				unsigned short segment = (unsigned short)segmentSize;
+				memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+
+				int sent_bytes = sendmsg(socket, &message, 0);
+
+				return sent_bytes == size;
+			}
+
+#endif
+
+			const unsigned char* segment = (const unsigned char*)data;
+			for (int offset = 0; offset < size; offset += segmentSize)
+			{
+				int bytes = size - offset < segmentSize ? size - offset : segmentSize;
+				if (!Send(destination, segment + offset, bytes))
+					return false;
+			}
+			return true;
+		}
+
+		// receive a (possibly coalesced) buffer, segmentSize is set to the size of each datagram within it
+		//  + without offload this is a plain Receive and segmentSize equals the bytes received
+
+		int ReceiveSegmented(Address& sender, void* data, int size, int& segmentSize)
+		{
+			assert(data);
+			assert(size > 0);
+
+			segmentSize = 0;
+			receive_time = 0;
+
+			if (socket == 0)
+				return 0;
+
+#if defined(__linux__)
+
+			if (offload)
+			{
+				sockaddr_in from;
+
+				iovec vector;
+				vector.iov_base = data;
+				vector.iov_len = size;
+
+				char control[ControlBufferSize];
+
+				msghdr message;
+				memset(&message, 0, sizeof(message));
+				message.msg_name = &from;
+				message.msg_namelen = sizeof(from);
+				message.msg_iov = &vector;
+				message.msg_iovlen = 1;
+				message.msg_control = control;
+				message.msg_controllen = sizeof(control);
+
+				int received_bytes = recvmsg(socket, &message, 0);
+
+				if (received_bytes <= 0)
+					return 0;
+
+				segmentSize = received_bytes;
+				for (cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg))
+				{
+					if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+					{
+						int gro = 0;
+						memcpy(&gro, CMSG_DATA(cmsg), sizeof(gro));
+						if (gro > 0)
+							segmentSize = gro;
+					}
+				}
+				receive_time = ReadControl(message);
+
+				sender = Address(ntohl(from.sin_addr.s_addr), ntohs(from.sin_port));
+
+				return received_bytes;
+			}
+
+#endif
+
+			int received_bytes = Receive(sender, data, size);
+			segmentSize = received_bytes;
+			return received_bytes;
+		}
+
+	private:
+
+		enum
+		{
+			ControlBufferSize = 128			// room for the ancillary data we ask the kernel for
+		};
+
+		int GetBufferSize(int option) const
+		{
+			if (socket == 0)
+				return 0;
+#if PLATFORM == PLATFORM_WINDOWS
+			typedef int socklen_t;
+#endif
+			int size = 0;
+			socklen_t length = sizeof(size);
+			if (getsockopt(socket, SOL_SOCKET, option, (char*)&size, &length) != 0)
+				return 0;
+			return size;
+		}
+
+#if defined(__linux__)
+
+		// pick up ancillary data delivered with a datagram, returns its receive timestamp (zero if none)
+
+		long long ReadControl(msghdr& message)
+		{
+			long long timestamp = 0;
+			if (message.msg_controllen == 0)
+				return timestamp;
+			for (cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg))
+			{
+				if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+					memcpy(&dropped_packets, CMSG_DATA(cmsg), sizeof(dropped_packets));
+				else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+				{
+					timespec time;
+					memcpy(&time, CMSG_DATA(cmsg), sizeof(time));
+					timestamp = (long long)time.tv_sec * 1000000000LL + time.tv_nsec;
+				}
+			}
+			return timestamp;
+		}
+
+		// recvmsg based receive, used when we need ancillary data back with the datagram
+
+		int ReceiveMessage(Address& sender, iovec vectors[], int count)
+		{
+			sockaddr_in from;
+
+			char control[ControlBufferSize];
+
+			msghdr message;
+			memset(&message, 0, sizeof(message));
+			message.msg_name = &from;
+			message.msg_namelen = sizeof(from);
+			message.msg_iov = vectors;
+			message.msg_iovlen = count;
+			message.msg_control = control;
+			message.msg_controllen = sizeof(control);
+
+			int received_bytes = recvmsg(socket, &message, 0);
+
+			if (received_bytes <= 0)
+				return 0;
+
+			receive_time = ReadControl(message);
+
+			sender = Address(ntohl(from.sin_addr.s_addr), ntohs(from.sin_port));
+
+			return received_bytes;
+		}
+
+#endif
+
+		int socket;
+		bool offload;
+		Address peer;						// connected peer, zero when unconnected
+		bool drop_accounting;				// SO_RXQ_OVFL enabled
+		unsigned int dropped_packets;		// datagrams dropped by the kernel on a full receive queue
+		bool timestamps;					// SO_TIMESTAMPNS enabled
+		long long receive_time;				// kernel receive timestamp of the last datagram read
+		bool zerocopy;						// SO_ZEROCOPY enabled
+		unsigned int zerocopy_next;			// id of the next zero copy send
+		unsigned int zerocopy_completed;	// every send id below this has completed
+		unsigned int zerocopy_copied;		// completions where the kernel copied after all
+		std::vector<unsigned char> zerocopy_done;	// completed flags for in flight send ids, indexed by id % MaxZeroCopyInFlight
+		bool txtime;						// SO_TXTIME enabled
+		int pacing_rate;					// SO_MAX_PACING_RATE in bytes per second, zero when unlimited
+#if defined(NET_IO_URING) && defined(__linux__)
+		IoRing* ring;
+#endif
+	};
+
+	// event driven wait on a socket handle plus a periodic timer
+	//  + linux: epoll on the socket and a timerfd, elsewhere: select with the time left until the next tick
+	//  + Wait returns as soon as data arrives or the timer is due, rather than sleeping a fixed tick
+	//  + SetDeadline pulls the next timer expiry in, so work due between ticks is not held back to the next one
+
+	class Reactor
+	{
+	public:
+
+		enum Event
+		{
+			Readable = 1,
+			TimerExpired = 2
+		};
+
+		Reactor()
+		{
+			handle = 0;
+			interval = 0.0f;
+			busy_poll = false;
+#if defined(__linux__)
+			epoll = -1;
+			timer = -1;
+#endif
+		}
+
+		~Reactor()
+		{
+			Close();
+		}
+
+		bool Open(int handle, float interval)
+		{
+			assert(handle != 0);
+			assert(interval > 0.0f);
+
+			this->handle = handle;
+			this->interval = interval;
+
+#if defined(__linux__)
+
+			epoll = epoll_create1(0);
+			timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+			if (epoll < 0 || timer < 0)
+			{
+				printf("failed to create reactor\n");
+				Close();
+				return false;
+			}
+
+			itimerspec spec;
+			spec.it_interval.tv_sec = (time_t)interval;
+			spec.it_interval.tv_nsec = (long)((interval - (float)spec.it_interval.tv_sec) * 1000000000.0f);
+			spec.it_value = spec.it_interval;
+			if (timerfd_settime(timer, 0, &spec, NULL) != 0)
+			{
+				printf("failed to arm reactor timer\n");
+				Close();
+				return false;
+			}
+
+			epoll_event event;
+			event.events = EPOLLIN;
+			event.data.u32 = Readable;
+			if (epoll_ctl(epoll, EPOLL_CTL_ADD, handle, &event) != 0)
+			{
+				printf("failed to watch socket\n");
+				Close();
+				return false;
+			}
+			event.data.u32 = TimerExpired;
+			if (epoll_ctl(epoll, EPOLL_CTL_ADD, timer, &event) != 0)
+			{
+				printf("failed to watch timer\n");
+				Close();
+				return false;
+			}
+
+#else
+
+			deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(interval));
+
+#endif
+
+			return true;
+		}
+
+		void Close()
+		{
+#if defined(__linux__)
+			if (timer >= 0)
+			{
+				close(timer);
+				timer = -1;
+			}
+			if (epoll >= 0)
+			{
+				close(epoll);
+				epoll = -1;
+			}
+#endif
+			handle = 0;
+		}
+
+		// busy poll mode: Wait spins on non-blocking polls instead of sleeping in the kernel
+		//  + removes the scheduler wakeup from receive latency, at the cost of a core held at 100%
+
+		void SetBusyPoll(bool enable)
+		{
+			busy_poll = enable;
+		}
+
+		bool IsBusyPoll() const
+		{
+			return busy_poll;
+		}
+
+		// have the timer fire seconds from now if that is sooner than the next tick, the tick carries on from there
+		//  + call before Wait with the time until the next Update deadline (e.g. ReliabilitySystem::GetNextExpiry),
+		//    negative seconds (nothing due) leave the tick as it is
+
+		void SetDeadline(float seconds)
+		{
+			assert(handle != 0);
+
+			if (seconds < 0.0f || seconds >= interval)
+				return;
+
+#if defined(__linux__)
+
+			itimerspec current;
+			if (timerfd_gettime(timer, &current) != 0)
+				return;
+			const long long remaining = (long long)current.it_value.tv_sec * 1000000000LL + current.it_value.tv_nsec;
+
+			// a zero it_value would disarm the timer, so a deadline already due fires a microsecond from now
+			long long wait = (long long)(seconds * 1000000000.0f);
+			if (wait < 1000)
+				wait = 1000;
+			if (remaining != 0 && wait >= remaining)
+				return;
+
+			itimerspec spec;
+			spec.it_interval = current.it_interval;
+			spec.it_value.tv_sec = (time_t)(wait / 1000000000LL);
+			spec.it_value.tv_nsec = (long)(wait % 1000000000LL);
+			timerfd_settime(timer, 0, &spec, NULL);
+
+#else
+
+			const std::chrono::steady_clock::time_point due = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(seconds));
+			if (due < deadline)
+				deadline = due;
+
+#endif
+		}
+
+		// block until the socket is readable and/or the timer fires, returns a mask of Event values
+
+		int Wait()
+		{
+			assert(handle != 0);
+
+			int events = 0;
+
+#if defined(__linux__)
+
+			epoll_event ready[2];
+			int count = 0;
+			if (busy_poll)
+			{
+				while ((count = epoll_wait(epoll, ready, 2, 0)) == 0);
+			}
+			else
+				count = epoll_wait(epoll, ready, 2, -1);
+			for (int i = 0; i < count; ++i)
+			{
+				if (ready[i].data.u32 == TimerExpired)
+				{
+					unsigned long long expirations = 0;
+					if (read(timer, &expirations, sizeof(expirations)) > 0)
+						events |= TimerExpired;
+				}
+				else
+					events |= Readable;
+			}
+
+#else
+
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			while (busy_poll && now < deadline)
+			{
+				timeval timeout;
+				timeout.tv_sec = 0;
+				timeout.tv_usec = 0;
+				fd_set readable;
+				FD_ZERO(&readable);
+				FD_SET(handle, &readable);
+				if (select(handle + 1, &readable, NULL, NULL, &timeout) > 0)
+				{
+					events |= Readable;
+					break;
+				}
+				now = std::chrono::steady_clock::now();
+			}
+			if (!busy_poll && now < deadline)
+			{
+				const long long remaining = std::chrono::duration_cast<std::chrono::microseconds>(deadline - now).count();
+				timeval timeout;
+				timeout.tv_sec = (long)(remaining / 1000000);
+				timeout.tv_usec = (long)(remaining % 1000000);
+				fd_set readable;
+				FD_ZERO(&readable);
+				FD_SET(handle, &readable);
+				if (select(handle + 1, &readable, NULL, NULL, &timeout) > 0)
+					events |= Readable;
+			}
+			if (std::chrono::steady_clock::now() >= deadline)
+			{
+				const std::chrono::steady_clock::duration tick = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(interval));
+				while (deadline <= std::chrono::steady_clock::now())
+					deadline += tick;
+				events |= TimerExpired;
+			}
+
+#endif
+
+			return events;
+		}
+
+	private:
+
+		int handle;
+		float interval;
+		bool busy_poll;				// spin instead of sleeping in Wait
+#if defined(__linux__)
+		int epoll;
+		int timer;
+#else
+		std::chrono::steady_clock::time_point deadline;
+#endif
+	};
+
+	// in-memory network link for reproducible tests and benchmarks without a real network
+	//  + endpoints are SimulatedSocket transports bound to a port on 127.0.0.1, packets between them are
+	//    delivered in virtual time, advanced by Update, so a run can go faster than real time
+	//  + impairments: loss, latency with uniform jitter, duplication, reordering, an mtu and a bandwidth cap with a drop-tail queue
+	//  + every random decision comes from one seeded generator, the same seed and call sequence replays the same run
+
+	class SimulatedNetwork
+	{
+	public:
+
+		SimulatedNetwork(unsigned int seed = 0)
+		{
+			SetSeed(seed);
+			time = 0.0;
+			loss = 0.0f;
+			latency = 0.0f;
+			jitter = 0.0f;
+			duplicates = 0.0f;
+			reorder = 0.0f;
+			reorder_delay = 0.0f;
+			bandwidth = 0.0f;
+			queue_time = 0.0f;
+			mtu = 0;
+			ResetCounters();
+		}
+
+		void SetSeed(unsigned int seed)
+		{
+			// xorshift must not start from zero
+			state = seed * 2654435761u + 1;
+		}
+
+		// percentage of packets dropped on the link
+
+		void SetLoss(float percent)
+		{
+			loss = percent;
+		}
+
+		// one-way delay in seconds, each packet varies uniformly by up to +/- jitter
+
+		void SetLatency(float seconds, float jitter = 0.0f)
+		{
+			latency = seconds;
+			this->jitter = jitter;
+		}
+
+		// percentage of packets delivered twice, the copy with its own delay
+
+		void SetDuplicates(float percent)
+		{
+			duplicates = percent;
+		}
+
+		// percentage of packets held back an extra delay seconds, so later packets overtake them
+
+		void SetReorder(float percent, float delay)
+		{
+			reorder = percent;
+			reorder_delay = delay;
+		}
+
+		// link rate in kbps towards each endpoint (zero for unlimited)
+		//  + packets queue for the link, those that would wait longer than queueTime seconds are dropped
+
+		void SetBandwidth(float kbps, float queueTime = 0.25f)
+		{
+			bandwidth = kbps;
+			queue_time = queueTime;
+		}
+
+		// largest datagram (udp payload bytes) the link carries, larger ones are dropped silently (zero for no limit)
+
+		void SetMtu(int bytes)
+		{
+			mtu = bytes;
+		}
+
+		// advance virtual time, packets due by then become receivable
+
+		void Update(float deltaTime)
+		{
+			time += deltaTime;
+		}
+
+		double GetTime() const
+		{
+			return time;
+		}
+
+		void ResetCounters()
+		{
+			sent_packets = 0;
+			lost_packets = 0;
+			duplicated_packets = 0;
+			reordered_packets = 0;
+			queue_drops = 0;
+			mtu_drops = 0;
+		}
+
+		unsigned int GetSentPackets() const { return sent_packets; }
+		unsigned int GetLostPackets() const { return lost_packets; }
+		unsigned int GetDuplicatedPackets() const { return duplicated_packets; }
+		unsigned int GetReorderedPackets() const { return reordered_packets; }
+		unsigned int GetQueueDrops() const { return queue_drops; }
+		unsigned int GetMtuDrops() const { return mtu_drops; }
+
+		// put a packet on the link, always succeeds (impairments are invisible to the sender, like udp)
+
+		bool Send(const Address& sender, const Address& destination, const void* data, int size)
+		{
+			assert(data);
+			assert(size > 0);
+
+			sent_packets++;
+
+			if (mtu > 0 && size > mtu)
+			{
+				mtu_drops++;
+				return true;
+			}
+
+			if (Random() * 100.0f < loss)
+			{
+				lost_packets++;
+				return true;
+			}
+
+			Endpoint& endpoint = endpoints[destination.GetPort()];
+
+			double departure = time;
+			if (bandwidth > 0.0f)
+			{
+				if (endpoint.link_free > time + queue_time)
+				{
+					queue_drops++;
+					return true;
+				}
+				if (endpoint.link_free > departure)
+					departure = endpoint.link_free;
+				departure += size * 8.0 / (bandwidth * 1000.0);
+				endpoint.link_free = departure;
+			}
+
+			const int copies = Random() * 100.0f < duplicates ? 2 : 1;
+			if (copies > 1)
+				duplicated_packets++;
+
+			for (int i = 0; i < copies; ++i)
+			{
+				SimulatedPacket packet;
+				packet.sender = sender;
+				packet.delivery = departure + latency + (Random() * 2.0f - 1.0f) * jitter;
+				if (Random() * 100.0f < reorder)
+				{
+					packet.delivery += reorder_delay;
+					reordered_packets++;
+				}
+				packet.data.assign((const unsigned char*)data, (const unsigned char*)data + size);
+
+				// keep the queue in delivery order, new packets usually belong at the back
+				std::list<SimulatedPacket>::iterator itor = endpoint.queue.end();
+				while (itor != endpoint.queue.begin())
+				{
+					std::list<SimulatedPacket>::iterator previous = itor;
+					--previous;
+					if (previous->delivery <= packet.delivery)
+						break;
+					itor = previous;
+				}
+				endpoint.queue.insert(itor, packet);
+			}
+
+			return true;
+		}
+
+		// take the next packet due at the endpoint on port, returns bytes received (zero if none)
+		//  + only packets from peer are delivered when peer is set, others are discarded like a connected socket does
+
+		int Receive(unsigned short port, const Address& peer, Address& sender, void* data, int size)
+		{
+			assert(data);
+			assert(size > 0);
+
+			std::map<unsigned short, Endpoint>::iterator endpoint = endpoints.find(port);
+			if (endpoint == endpoints.end())
+				return 0;
+
+			std::list<SimulatedPacket>& queue = endpoint->second.queue;
+			while (!queue.empty() && queue.front().delivery <= time)
+			{
+				SimulatedPacket& packet = queue.front();
+				if (peer.GetAddress() != 0 && packet.sender != peer)
+				{
+					queue.pop_front();
+					continue;
+				}
+				int bytes = (int)packet.data.size() < size ? (int)packet.data.size() : size;
+				memcpy(data, &packet.data[0], bytes);
+				sender = packet.sender;
+				queue.pop_front();
+				return bytes;
+			}
+			return 0;
+		}
+
+		// drop everything queued for port, used when an endpoint closes
+
+		void Unbind(unsigned short port)
+		{
+			endpoints.erase(port);
+		}
+
+	private:
+
+		struct SimulatedPacket
+		{
+			Address sender;
+			double delivery;						// virtual time the packet becomes receivable
+			std::vector<unsigned char> data;
+		};
+
+		struct Endpoint
+		{
+			Endpoint() : link_free(0.0) {}
+			std::list<SimulatedPacket> queue;		// in flight towards this endpoint, in delivery order
+			double link_free;						// virtual time the rate limited link finishes its backlog
+		};
+
+		// uniform in [0,1), xorshift32
+
+		float Random()
+		{
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			return (state >> 8) * (1.0f / 16777216.0f);
+		}
+
+		unsigned int state;
+		double time;
+		float loss;
+		float latency;
+		float jitter;
+		float duplicates;
+		float reorder;
+		float reorder_delay;
+		float bandwidth;
+		float queue_time;
+		int mtu;
+		std::map<unsigned short, Endpoint> endpoints;
+
+		unsigned int sent_packets;
+		unsigned int lost_packets;
+		unsigned int duplicated_packets;
+		unsigned int reordered_packets;
+		unsigned int queue_drops;
+		unsigned int mtu_drops;
+	};
+
+	// transport endpoint on a SimulatedNetwork, stands in for a Socket (see Connection::SetTransport)
+
+	class SimulatedSocket : public Transport
+	{
+	public:
+
+		SimulatedSocket(SimulatedNetwork& network) : network(network)
+		{
+			port = 0;
+		}
+
+		~SimulatedSocket()
+		{
+			Close();
+		}
+
+		// the simulated network has no port sharing (SO_REUSEPORT), each port is one socket's and shared is ignored
+
+		bool Open(unsigned short port, bool /*shared*/ = false)
+		{
+			assert(!IsOpen());
+			assert(port != 0);
+			this->port = port;
+			return true;
+		}
+
+		void Close()
+		{
+			if (port != 0)
+				network.Unbind(port);
+			port = 0;
+			peer = Address();
+		}
+
+		bool IsOpen() const
+		{
+			return port != 0;
+		}
+
+		bool Send(const Address& destination, const void* data, int size)
+		{
+			if (port == 0)
+				return false;
+			return network.Send(Address(127, 0, 0, 1, port), destination, data, size);
+		}
+
+		int Receive(Address& sender, void* data, int size)
+		{
+			if (port == 0)
+				return 0;
+			return network.Receive(port, peer, sender, data, size);
+		}
+
+		bool Connect(const Address& destination)
+		{
+			peer = destination;
+			return true;
+		}
+
+		void Disconnect()
+		{
+			peer = Address();
+		}
+
+	private:
+
+		SimulatedNetwork& network;
+		unsigned short port;
+		Address peer;
+	};
+
+	// connection level control packets (path mtu probes): the protocol id inverted, a type byte and a 16 bit size
+	//  + never delivered to the caller, so any endpoint speaking the protocol must handle them itself
+
+	enum ControlPacket
+	{
+		ControlHeaderSize = 7,
+		CookieSize = 12,
+		MaxControlSize = ControlHeaderSize + CookieSize,	// largest control packet, probes aside
+		ProbeRequest = 1,				// padded to the probed size, answered with a ProbeReply
+		ProbeReply = 2,					// size is the number of bytes of the request that arrived
+		ConnectRequest = 3,				// client hello, padded to MaxControlSize so the challenge never amplifies it
+		ConnectChallenge = 4,			// server reply carrying a cookie, the server keeps no state
+		ConnectResponse = 5,			// client echoes the cookie, proving it receives at its address, size holds the options it asks for
+		ConnectAccept = 6				// cookie checked out, the server has set up the connection, size holds the options granted
+	};
+
+	// per connection options, agreed on in the connect handshake: granted when both ends offer them
+
+	enum ConnectOption
+	{
+		CompactHeaderOption = 1,		// reliability headers in the compact encoding, see write_compact_header
+		AckBits64Option = 2,			// ack bits fields 64, 128 or 256 bits wide rather than 32, see AckBits
+		AckBits128Option = 4,			//  + each end offers every width up to the widest it takes,
+		AckBits256Option = 8			//    and the widest both offer is used
+	};
+
+	// the ack bits options to offer for fields up to bits wide
+
+	inline unsigned int ack_bits_options(int bits)
+	{
+		unsigned int options = 0;
+		if (bits >= 64)
+			options |= AckBits64Option;
+		if (bits >= 128)
+			options |= AckBits128Option;
+		if (bits >= 256)
+			options |= AckBits256Option;
+		return options;
+	}
+
+	// the ack bits width agreed with these options granted
+
+	inline int ack_bits_width(unsigned int options)
+	{
+		if (options & AckBits256Option)
+			return 256;
+		if (options & AckBits128Option)
+			return 128;
+		if (options & AckBits64Option)
+			return 64;
+		return 32;
+	}
+
+	inline void write_control(unsigned char* packet, unsigned int protocolId, int type, int size)
+	{
+		packet[0] = (unsigned char)(~protocolId >> 24);
+		packet[1] = (unsigned char)((~protocolId >> 16) & 0xFF);
+		packet[2] = (unsigned char)((~protocolId >> 8) & 0xFF);
+		packet[3] = (unsigned char)(~protocolId & 0xFF);
+		packet[4] = (unsigned char)type;
+		packet[5] = (unsigned char)(size >> 8);
+		packet[6] = (unsigned char)(size & 0xFF);
+	}
+
+	inline bool is_control(const unsigned char* packet, int bytes, unsigned int protocolId)
+	{
+		return bytes >= ControlHeaderSize &&
+			packet[0] == (unsigned char)(~protocolId >> 24) &&
+			packet[1] == (unsigned char)((~protocolId >> 16) & 0xFF) &&
+			packet[2] == (unsigned char)((~protocolId >> 8) & 0xFF) &&
+			packet[3] == (unsigned char)(~protocolId & 0xFF);
+	}
+
+	// SipHash-2-4: keyed 64 bit hash, a fast and secure MAC for short messages
+
+	inline unsigned long long siphash(const unsigned char key[16], const unsigned char* data, int size)
+	{
+		#define NET_SIPROUND \
+			v0 += v1; v1 = (v1 << 13) | (v1 >> 51); v1 ^= v0; v0 = (v0 << 32) | (v0 >> 32); \
+			v2 += v3; v3 = (v3 << 16) | (v3 >> 48); v3 ^= v2; \
+			v0 += v3; v3 = (v3 << 21) | (v3 >> 43); v3 ^= v0; \
+			v2 += v1; v1 = (v1 << 17) | (v1 >> 47); v1 ^= v2; v2 = (v2 << 32) | (v2 >> 32);
+		unsigned long long k0 = 0;
+		unsigned long long k1 = 0;
+		for (int i = 7; i >= 0; --i)
+		{
+			k0 = (k0 << 8) | key[i];
+			k1 = (k1 << 8) | key[i + 8];
+		}
+		unsigned long long v0 = k0 ^ 0x736F6D6570736575ULL;
+		unsigned long long v1 = k1 ^ 0x646F72616E646F6DULL;
+		unsigned long long v2 = k0 ^ 0x6C7967656E657261ULL;
+		unsigned long long v3 = k1 ^ 0x7465646279746573ULL;
+		const int blocks = size / 8;
+		for (int block = 0; block < blocks; ++block)
+		{
+			unsigned long long m = 0;
+			for (int i = 7; i >= 0; --i)
+				m = (m << 8) | data[block * 8 + i];
+			v3 ^= m;
+			NET_SIPROUND NET_SIPROUND
+			v0 ^= m;
+		}
+		unsigned long long last = (unsigned long long)(size & 0xFF) << 56;
+		for (int i = size - 1; i >= blocks * 8; --i)
+			last |= (unsigned long long)data[i] << ((i - blocks * 8) * 8);
+		v3 ^= last;
+		NET_SIPROUND NET_SIPROUND
+		v0 ^= last;
+		v2 ^= 0xFF;
+		NET_SIPROUND NET_SIPROUND NET_SIPROUND NET_SIPROUND
+		#undef NET_SIPROUND
+		return v0 ^ v1 ^ v2 ^ v3;
+	}
+
+	// connect cookies: a server hands one to each ConnectRequest and accepts a client that echoes it back
+	//  + a cookie is its issue time (seconds) and a MAC over the client address, protocol id and that time,
+	//    so the server checks it without having stored anything and only a client receiving at the address has it
+	//  + cookies expire after CookieLifetime seconds, the key is random per instance
+
+	class CookieSecret
+	{
+	public:
+
+		CookieSecret()
+		{
+			Regenerate();
+		}
+
+		void Regenerate()
+		{
+			std::random_device device;
+			for (int i = 0; i < 16; i += 4)
+			{
+				const unsigned int value = device();
+				key[i + 0] = (unsigned char)(value >> 24);
+				key[i + 1] = (unsigned char)((value >> 16) & 0xFF);
+				key[i + 2] = (unsigned char)((value >> 8) & 0xFF);
+				key[i + 3] = (unsigned char)(value & 0xFF);
+			}
+		}
+
+		void Write(unsigned char cookie[], const Address& address, unsigned int protocolId) const
+		{
+			Write(cookie, address, protocolId, Now());
+		}
+
+		bool Check(const unsigned char cookie[], const Address& address, unsigned int protocolId) const
+		{
+			const unsigned int issued = ((unsigned int)cookie[0] << 24) | ((unsigned int)cookie[1] << 16) |
+				((unsigned int)cookie[2] << 8) | ((unsigned int)cookie[3]);
+			if (Now() - issued > CookieLifetime)
+				return false;
+			unsigned char expected[CookieSize];
+			Write(expected, address, protocolId, issued);
+			// compare every byte, so the time taken gives away nothing about the MAC
+			unsigned char difference = 0;
+			for (int i = 0; i < CookieSize; ++i)
+				difference |= expected[i] ^ cookie[i];
+			return difference == 0;
+		}
+
+	private:
+
+		static unsigned int Now()
+		{
+			return (unsigned int)(timestamp_now() / 1000000000LL);
+		}
+
+		void Write(unsigned char cookie[], const Address& address, unsigned int protocolId, unsigned int issued) const
+		{
+			const unsigned int values[3] = { address.GetAddress(), protocolId, issued };
+			unsigned char message[14];
+			for (int i = 0; i < 3; ++i)
+			{
+				message[i * 4 + 0] = (unsigned char)(values[i] >> 24);
+				message[i * 4 + 1] = (unsigned char)((values[i] >> 16) & 0xFF);
+				message[i * 4 + 2] = (unsigned char)((values[i] >> 8) & 0xFF);
+				message[i * 4 + 3] = (unsigned char)(values[i] & 0xFF);
+			}
+			message[12] = (unsigned char)(address.GetPort() >> 8);
+			message[13] = (unsigned char)(address.GetPort() & 0xFF);
+			const unsigned long long mac = siphash(key, message, sizeof(message));
+			for (int i = 0; i < 4; ++i)
+				cookie[i] = message[8 + i];
+			for (int i = 0; i < 8; ++i)
+				cookie[4 + i] = (unsigned char)(mac >> (56 - i * 8));
+		}
+
+		unsigned char key[16];
+	};
+
+	// copy the first size bytes the segments hold back to back into buffer
+
+	inline void gather_prefix(unsigned char* buffer, int size, const Segment segments[], int count)
+	{
+		for (int i = 0; i < count && size > 0; ++i)
+		{
+			const int bytes = size < segments[i].size ? size : segments[i].size;
+			std::memcpy(buffer, segments[i].data, bytes);
+			buffer += bytes;
+			size -= bytes;
+		}
+	}
+
+	// connection
+
+	class Connection
+	{
+	public:
+
+		enum Mode
+		{
+			None,
+			Client,
+			Server
+		};
+
+		enum Pacing
+		{
+			PacingOff,
+			PacingRate,			// the kernel caps the socket at the pacing rate (SO_MAX_PACING_RATE)
+			PacingTxTime		// each batched packet is stamped with its own transmit time (SO_TXTIME)
+		};
+
+		Connection(unsigned int protocolId, float timeout)
+		{
+			this->protocolId = protocolId;
+			this->timeout = timeout;
+			mode = None;
+			running = false;
+			connected_socket = true;
+			transport = &socket;
+			pacing = PacingOff;
+			pacingRate = 0;
+			nextTransmitTime = 0;
+			maxPacketSize = DefaultMaxPacketSize;
+			discovery = false;
+			handshake = false;
+			offeredOptions = 0;
+			ClearData();
+		}
+
+		virtual ~Connection()
+		{
+			if (IsRunning())
+				Stop();
+		}
+
+		// run the connection over another transport than its own udp socket, e.g. a SimulatedSocket
+		//  + set before Start, the transport must outlive the connection, NULL restores the socket
+		//  + the socket tuning calls (offload, ring, zero copy, buffer sizes...) return false on other transports
+
+		void SetTransport(Transport* transport)
+		{
+			assert(!running);
+			this->transport = transport ? transport : &socket;
+		}
+
+		bool Start(int port, bool shared = false)
+		{
+			assert(!running);
+			printf("start connection on port %d\n", port);
+			if (!transport->Open(port, shared))
+				return false;
+			packetBuffer.resize(maxPacketSize);
+			batchBuffer.resize(MaxPacketBatch * maxPacketSize);
+			running = true;
+			OnStart();
+			return true;
+		}
+
+		void Stop()
+		{
+			assert(running);
+			printf("stop connection\n");
+			bool connected = IsConnected();
+			ClearData();
+			transport->Close();
+			running = false;
+			pacing = PacingOff;
+			pacingRate = 0;
+			discovery = false;
+			if (connected)
+				OnDisconnect();
+			OnStop();
+		}
+
+		bool IsRunning() const
+		{
+			return running;
+		}
+
+		void Listen()
 		{
 			printf("server listening for connection\n");
 			bool connected = IsConnected();
 			ClearData();
-			if (connected)
-				OnDisconnect();
-			mode = Server;
-			state = Listening;
+			if (connected)
+				OnDisconnect();
+			mode = Server;
+			state = Listening;
+		}
+
+		void Connect(const Address& address)
+		{
+			printf("client connecting to %d.%d.%d.%d:%d\n",
+				address.GetA(), address.GetB(), address.GetC(), address.GetD(), address.GetPort());
+			bool connected = IsConnected();
+			ClearData();
+			if (connected)
+				OnDisconnect();
+			mode = Client;
+			state = Connecting;
+			this->address = address;
+			if (connected_socket)
+				transport->Connect(address);
+		}
+
+		bool IsConnecting() const
+		{
+			return state == Connecting;
+		}
+
+		// stateless connect handshake (see CookieSecret): a listening server only accepts a client that has
+		// echoed a cookie, so spoofed or stray packets can neither take over the connection nor cost it state
+		//  + a connecting client sends a ConnectRequest, then the cookie, every HandshakeRetryTime until accepted
+		//  + both ends must enable it, a client should hold back its packets until IsConnected
+
+		void EnableHandshake()
+		{
+			handshake = true;
+		}
+
+		bool IsHandshakeEnabled() const
+		{
+			return handshake;
+		}
+
+		// options agreed with the peer in the handshake (see ConnectOption), zero without one
+
+		unsigned int GetOptions() const
+		{
+			return options;
+		}
+
+		bool ConnectFailed() const
+		{
+			return state == ConnectFail;
+		}
+
+		bool IsConnected() const
+		{
+			return state == Connected;
+		}
+
+		bool IsListening() const
+		{
+			return state == Listening;
+		}
+
+		Mode GetMode() const
+		{
+			return mode;
+		}
+
+		virtual void Update(float deltaTime)
+		{
+			assert(running);
+			socket.PollCompletions();
+			if (discovery && state == Connected)
+				UpdateDiscovery(deltaTime);
+			if (handshake && state == Connecting)
+			{
+				handshakeTimer += deltaTime;
+				if (handshakeTimer >= HandshakeRetryTime)
+					SendHandshake();
+			}
+			timeoutAccumulator += deltaTime;
+			if (timeoutAccumulator > timeout)
+			{
+				if (state == Connecting)
+				{
+					printf("connect timed out\n");
+					ClearData();
+					state = ConnectFail;
+					OnDisconnect();
+				}
+				else if (state == Connected)
+				{
+					printf("connection timed out\n");
+					ClearData();
+					if (state == Connecting)
+						state = ConnectFail;
+					OnDisconnect();
+				}
+			}
+		}
+
+		virtual bool SendPacket(const unsigned char data[], int size)
+		{
+			Segment segment = { (void*)data, size };
+			return SendSegments(&segment, 1);
+		}
+
+		virtual int ReceivePacket(unsigned char data[], int size)
+		{
+			Segment segment = { data, size };
+			return ReceiveSegments(&segment, 1);
+		}
+
+		// receive the next payload straight into a buffer from pool, returns its size and zero when
+		// nothing is pending or the pool is empty. release the packet to the pool when done with it
+
+		int ReceivePooledPacket(PacketPool& pool, PooledPacket& packet)
+		{
+			packet.data = NULL;
+			packet.size = 0;
+			packet.index = pool.Acquire();
+			if (packet.index < 0)
+				return 0;
+			unsigned char* buffer = pool.GetBuffer(packet.index);
+			const int size = ReceivePacket(buffer, pool.GetBufferSize());
+			if (size <= 0)
+			{
+				pool.Release(packet);
+				return 0;
+			}
+			packet.data = buffer;
+			packet.size = size;
+			return size;
+		}
+
+		// largest datagram (udp payload bytes) this connection sends or receives, sizes its buffers
+		//  + set before Start, longer datagrams are truncated on receive and refused on send
+
+		void SetMaxPacketSize(int size)
+		{
+			assert(!running);
+			assert(size > 4 && size <= MaxOffloadSize);
+			maxPacketSize = size;
+			ResetDiscovery();
+		}
+
+		int GetMaxPacketSize() const
+		{
+			return maxPacketSize;
+		}
+
+		// path mtu discovery (DPLPMTUD, RFC 8899): padded probe datagrams confirmed by a reply from the peer
+		// search for the largest datagram the path delivers, between BasePacketSize and GetMaxPacketSize
+		//  + probes are connection level control packets, they never reach the caller or count as packets sent
+		//  + the search runs from Update once connected, and again every ProbeRaiseTime in case the path grew
+		//  + both ends must run a version that answers probes, a peer that does not leaves the size at BasePacketSize
+
+		bool EnablePathMtuDiscovery()
+		{
+			assert(running);
+			if (transport == &socket && !socket.EnablePathMtuProbing())
+				return false;
+			discovery = true;
+			ResetDiscovery();
+			return true;
+		}
+
+		bool IsPathMtuDiscoveryEnabled() const
+		{
+			return discovery;
+		}
+
+		// largest datagram known to fit the path to the peer (BasePacketSize until discovery shows more)
+
+		int GetPathMtu() const
+		{
+			return pathMtu;
+		}
+
+		// largest payload for SendPacket that fits the path
+
+		int GetMaxPayloadSize() const
+		{
+			return GetPathMtu() - GetHeaderSize();
+		}
+
+		// send a packet without copying its payload, data must stay untouched until IsSendComplete(id)
+		//  + without zero copy enabled this is a plain SendPacket and the send is complete on return
+
+		virtual bool SendPacketZeroCopy(const unsigned char data[], int size, unsigned int& id)
+		{
+			return SendZeroCopy(NULL, 0, data, size, id);
+		}
+
+		// switch the socket to zero copy sends (MSG_ZEROCOPY), returns false if unavailable
+
+		bool EnableZeroCopy()
+		{
+			assert(running);
+			if (transport != &socket)
+				return false;
+			if (!socket.EnableZeroCopy())
+				return false;
+			zeroCopyHeaders.resize(MaxZeroCopyInFlight * MaxZeroCopyHeader);
+			printf("zero copy send enabled\n");
+			return true;
+		}
+
+		bool IsZeroCopyEnabled() const
+		{
+			return socket.IsZeroCopyEnabled();
+		}
+
+		// collect zero copy completions now rather than waiting for the next Update, returns the number completed
+
+		int PollCompletions()
+		{
+			return socket.PollCompletions();
+		}
+
+		bool IsSendComplete(unsigned int id) const
+		{
+			return !socket.IsZeroCopyEnabled() || socket.IsSendComplete(id);
+		}
+
+		unsigned int GetCopiedSends() const
+		{
+			return socket.GetCopiedSends();
+		}
+
+		// ask the kernel to timestamp received packets, see GetReceiveTime
+
+		bool EnableTimestamps()
+		{
+			assert(running);
+			if (transport != &socket)
+				return false;
+			return socket.EnableTimestamps();
+		}
+
+		// kernel receive time in nanoseconds of the packet last returned by ReceivePacket, zero if unknown
+
+		long long GetReceiveTime() const
+		{
+			return receiveTime;
+		}
+
+		// switch the socket to segmentation offload (GSO/GRO), returns false if unavailable
+
+		bool EnableOffload()
+		{
+			assert(running);
+			if (transport != &socket)
+				return false;
+			if (!socket.EnableOffload())
+				return false;
+			offloadBuffer.resize(MaxOffloadSize);
+			offloadSendBuffer.resize(MaxOffloadSize);
+			offloadSize = 0;
+			offloadOffset = 0;
+			offloadSegment = 0;
+			printf("udp segmentation offload enabled\n");
+			return true;
+		}
+
+		bool IsOffloadEnabled() const
+		{
+			return socket.IsOffloadEnabled();
+		}
+
+		// switch the socket to the io_uring backend, returns false if not compiled in or unavailable
+
+		bool EnableRing()
+		{
+			assert(running);
+			if (transport != &socket)
+				return false;
+			if (!socket.EnableRing(maxPacketSize))
+				return false;
+			printf("io_uring socket backend enabled\n");
+			return true;
+		}
+
+		bool IsRingEnabled() const
+		{
+			return socket.IsRingEnabled();
+		}
+
+		int GetHandle() const
+		{
+			return transport->GetHandle();
+		}
+
+		bool SetBufferSizes(int receiveSize, int sendSize)
+		{
+			assert(running);
+			if (transport != &socket)
+				return false;
+			return socket.SetBufferSizes(receiveSize, sendSize);
+		}
+
+		int GetReceiveBufferSize() const
+		{
+			return socket.GetReceiveBufferSize();
+		}
+
+		int GetSendBufferSize() const
+		{
+			return socket.GetSendBufferSize();
+		}
+
+		bool EnableDropAccounting()
+		{
+			assert(running);
+			if (transport != &socket)
+				return false;
+			return socket.EnableDropAccounting();
+		}
+
+		// packets lost to our own receive queue overflowing, as opposed to loss on the network
+
+		unsigned int GetDroppedPackets() const
+		{
+			return socket.GetDroppedPackets();
+		}
+
+		// spin on the device queue for up to microseconds on receive (SO_BUSY_POLL), see Reactor::SetBusyPoll for the loop side
+
+		bool EnableBusyPoll(int microseconds)
+		{
+			assert(running);
+			if (transport != &socket)
+				return false;
+			return socket.EnableBusyPoll(microseconds);
+		}
+
+		// let the kernel space packets out at the pacing rate instead of sending each batch as a burst
+		//  + PacingTxTime spaces the packets of SendPackets by their size at the rate, so it rules out offload and the ring
+
+		bool EnablePacing(Pacing mode)
+		{
+			assert(running);
+			if (transport != &socket)
+				return false;
+			if (mode == PacingTxTime && !socket.IsTxTimeEnabled() && !socket.EnableTxTime())
+				return false;
+			if (pacing == PacingRate && mode != PacingRate)
+				socket.SetPacingRate(0);
+			pacing = mode;
+			nextTransmitTime = 0;
+			return true;
+		}
+
+		Pacing GetPacing() const
+		{
+			return pacing;
+		}
+
+		// pacing rate in bytes per second of datagrams on the wire, call it whenever the send rate changes
+
+		bool SetPacingRate(int bytesPerSecond)
+		{
+			assert(running);
+			pacingRate = bytesPerSecond;
+			if (pacing == PacingRate)
+				return socket.SetPacingRate(bytesPerSecond);
+			return pacing == PacingTxTime;
+		}
+
+		// connect() the socket to the peer once known (client on Connect, server on accept), on by default
+
+		void SetConnectedSocket(bool enable)
+		{
+			connected_socket = enable;
+		}
+
+		// send a burst of packets to the connected address, returns the number sent
+
+		virtual int SendPackets(const unsigned char* const data[], const int sizes[], int count)
+		{
+			assert(running);
+			assert(count <= MaxPacketBatch);
+			if (address.GetAddress() == 0)
+				return 0;
+			if (socket.IsOffloadEnabled() && count > 1)
+			{
+				// equally sized packets go out as one super-buffer, segmented by the kernel
+				bool uniform = sizes[count - 1] <= sizes[0];
+				for (int i = 1; i < count - 1 && uniform; ++i)
+					uniform = sizes[i] == sizes[0];
+				if (uniform && sizes[0] + 4 <= maxPacketSize)
+				{
+					// a super-buffer holds at most MaxOffloadSize bytes, larger batches take several sends
+					const int segmentSize = sizes[0] + 4;
+					unsigned char* buffer = &offloadSendBuffer[0];
+					int sent = 0;
+					while (sent < count)
+					{
+						int offset = 0;
+						int segments = 0;
+						for (int i = sent; i < count && offset + sizes[i] + 4 <= MaxOffloadSize; ++i)
+						{
+							buffer[offset + 0] = (unsigned char)(protocolId >> 24);
+							buffer[offset + 1] = (unsigned char)((protocolId >> 16) & 0xFF);
+							buffer[offset + 2] = (unsigned char)((protocolId >> 8) & 0xFF);
+							buffer[offset + 3] = (unsigned char)((protocolId) & 0xFF);
+							std::memcpy(buffer + offset + 4, data[i], sizes[i]);
+							offset += sizes[i] + 4;
+							segments++;
+						}
+						if (!socket.SendSegmented(address, buffer, offset, segmentSize))
+							break;
+						sent += segments;
+					}
+					return sent;
+				}
+			}
+			Datagram datagrams[MaxPacketBatch];
+			for (int i = 0; i < count; ++i)
+			{
+				if (sizes[i] + 4 > maxPacketSize)
+					return transport->SendBatch(datagrams, i);
+				unsigned char* packet = &batchBuffer[i * maxPacketSize];
+				packet[0] = (unsigned char)(protocolId >> 24);
+				packet[1] = (unsigned char)((protocolId >> 16) & 0xFF);
+				packet[2] = (unsigned char)((protocolId >> 8) & 0xFF);
+				packet[3] = (unsigned char)((protocolId) & 0xFF);
+				std::memcpy(&packet[4], data[i], sizes[i]);
+				datagrams[i].address = address;
+				datagrams[i].data = packet;
+				datagrams[i].size = sizes[i] + 4;
+				datagrams[i].timestamp = NextTransmitTime(sizes[i] + 4);
+			}
+			return transport->SendBatch(datagrams, count);
+		}
+
+		// receive a burst of packets into data[], sizes[] holds buffer sizes on input and bytes read on output
+		//  + packets that fail the protocol/address checks are skipped, so valid packets are compacted to the front
+		//  + times[], if given, receives the kernel receive time of each packet (see GetReceiveTime)
+		//  + returns the number of valid packets received
+
+		virtual int ReceivePackets(unsigned char* data[], int sizes[], int count, long long times[] = NULL)
+		{
+			assert(running);
+			assert(count <= MaxPacketBatch);
+			if (socket.IsOffloadEnabled())
+			{
+				int valid = 0;
+				for (int i = 0; i < count && valid < count; ++i)
+				{
+					Address sender;
+					int bytes_read = 0;
+					const unsigned char* segment = NextSegment(sender, bytes_read);
+					if (bytes_read == 0)
+						break;
+					bytes_read = ProcessPacket(sender, segment, bytes_read, data[valid], sizes[valid]);
+					if (bytes_read > 0)
+					{
+						if (times)
+							times[valid] = offloadTime;
+						sizes[valid++] = bytes_read;
+					}
+				}
+				return valid;
+			}
+			Datagram datagrams[MaxPacketBatch];
+			for (int i = 0; i < count; ++i)
+			{
+				datagrams[i].data = &batchBuffer[i * maxPacketSize];
+				datagrams[i].size = maxPacketSize;
+			}
+			int received = transport->ReceiveBatch(datagrams, count);
+			int valid = 0;
+			for (int i = 0; i < received; ++i)
+			{
+				int bytes_read = ProcessPacket(datagrams[i].address, (const unsigned char*)datagrams[i].data, datagrams[i].size, data[valid], sizes[valid]);
+				if (bytes_read > 0)
+				{
+					if (times)
+						times[valid] = datagrams[i].timestamp;
+					sizes[valid++] = bytes_read;
+				}
+			}
+			return valid;
+		}
+
+		int GetHeaderSize() const
+		{
+			return 4;
+		}
+
+	protected:
+
+		virtual void OnStart() {}
+		virtual void OnStop() {}
+		virtual void OnConnect() {}
+		virtual void OnDisconnect() {}
+
+		// options this end supports, set before connecting or listening
+
+		void OfferOptions(unsigned int options)
+		{
+			offeredOptions |= options;
+		}
+
+		// send the segments as one packet behind the protocol id, without copying them
+
+		bool SendSegments(const Segment segments[], int count)
+		{
+			assert(running);
+			assert(count > 0 && count < MaxSegments);
+			if (address.GetAddress() == 0)
+				return false;
+			unsigned char header[4];
+			header[0] = (unsigned char)(protocolId >> 24);
+			header[1] = (unsigned char)((protocolId >> 16) & 0xFF);
+			header[2] = (unsigned char)((protocolId >> 8) & 0xFF);
+			header[3] = (unsigned char)((protocolId) & 0xFF);
+			Segment packet[MaxSegments];
+			packet[0].data = header;
+			packet[0].size = 4;
+			for (int i = 0; i < count; ++i)
+				packet[i + 1] = segments[i];
+			if (4 + segments_size(segments, count) > maxPacketSize)
+				return false;
+			return transport->SendSegments(address, packet, count + 1);
+		}
+
+		// receive the payload of the next packet scattered over the segments
+		//  + returns the payload size, at most the segments' total, and zero when nothing is pending
+		//  + the protocol id lands in a header of its own and the payload straight in the segments,
+		//    whatever does not fit spills into packetBuffer. GRO coalesced reads are copied out
+
+		int ReceiveSegments(const Segment segments[], int count)
+		{
+			assert(running);
+			assert(count > 0 && count <= MaxSegments - 2);
+			const int capacity = segments_size(segments, count);
+			Address sender;
+			int result = 0;
+			do
+			{
+				// control packets (path mtu probes) are consumed here, keep reading until a payload or nothing
+				if (socket.IsOffloadEnabled())
+				{
+					int bytes_read = 0;
+					const unsigned char* segment = NextSegment(sender, bytes_read);
+					receiveTime = offloadTime;
+					result = ProcessHeader(sender, segment, bytes_read);
+					if (result > 0)
+						result = scatter_segments(segment + 4, result, segments, count);
+				}
+				else
+				{
+					unsigned char header[MaxControlSize];
+					Segment packet[MaxSegments];
+					packet[0].data = header;
+					packet[0].size = 4;
+					for (int i = 0; i < count; ++i)
+						packet[i + 1] = segments[i];
+					packet[count + 1].data = &packetBuffer[0];
+					packet[count + 1].size = maxPacketSize;
+					int bytes_read = transport->ReceiveSegments(sender, packet, count + 2);
+					receiveTime = transport->GetReceiveTime();
+					// a control packet runs on into the payload segments, fetch the rest of it
+					if (is_control(header, bytes_read, protocolId))
+						gather_prefix(header + 4, (bytes_read < MaxControlSize ? bytes_read : MaxControlSize) - 4, packet + 1, count + 1);
+					result = ProcessHeader(sender, header, bytes_read);
+					if (result > capacity)
+						result = capacity;
+				}
+			}
+			while (result < 0);
+			return result;
+		}
+
+		// validate a raw packet read from the socket and update connection state, copies up to size bytes of payload into data
+		//  + returns -1 for a control packet, which is handled here and has no payload for the caller
+
+		int ProcessPacket(const Address& sender, const unsigned char packet[], int bytes_read, unsigned char data[], int size)
+		{
+			int payload = ProcessHeader(sender, packet, bytes_read);
+			if (payload <= 0)
+				return payload;
+			if (payload > size)
+				payload = size;
+			memcpy(data, &packet[4], payload);
+			return payload;
+		}
+
+		// validate a packet from its first bytes (up to MaxControlSize of them) and update connection state
+		//  + returns the payload size, -1 for a control packet, which is handled here, or zero to drop the packet
+
+		int ProcessHeader(const Address& sender, const unsigned char packet[], int bytes_read)
+		{
+			if (bytes_read == 0)
+				return 0;
+			if (bytes_read <= 4)
+				return 0;
+			if (is_control(packet, bytes_read, protocolId))
+			{
+				ProcessControl(sender, packet, bytes_read);
+				return -1;
+			}
+			if (packet[0] != (unsigned char)(protocolId >> 24) ||
+				packet[1] != (unsigned char)((protocolId >> 16) & 0xFF) ||
+				packet[2] != (unsigned char)((protocolId >> 8) & 0xFF) ||
+				packet[3] != (unsigned char)(protocolId & 0xFF))
+				return 0;
+			if (mode == Server && !IsConnected())
+			{
+				// with the handshake only a returned cookie connects a client
+				if (handshake)
+					return 0;
+				Accept(sender);
+			}
+			if (sender == address)
+			{
+				if (mode == Client && state == Connecting)
+				{
+					// with the handshake only the accept connects, it carries the options the packets are formatted with
+					if (handshake)
+						return 0;
+					printf("client completes connection with server\n");
+					state = Connected;
+					OnConnect();
+				}
+				timeoutAccumulator = 0.0f;
+				return bytes_read - 4;
+			}
+			return 0;
+		}
+
+		// send protocol id + header by copy and data by reference as one packet
+		//  + the headers live in a slot per in flight send id, so they outlive the call just like data does
+
+		bool SendZeroCopy(const unsigned char header[], int headerSize, const unsigned char data[], int size, unsigned int& id)
+		{
+			assert(running);
+			assert(headerSize >= 0 && headerSize + 4 <= MaxZeroCopyHeader);
+			id = 0;
+			if (address.GetAddress() == 0)
+				return false;
+			if (!socket.IsZeroCopyEnabled())
+			{
+				Segment segments[2] = { { (void*)header, headerSize }, { (void*)data, size } };
+				if (headerSize == 0)
+					return SendSegments(segments + 1, 1);
+				return SendSegments(segments, 2);
+			}
+			unsigned char* slot = &zeroCopyHeaders[(socket.GetNextZeroCopyId() % MaxZeroCopyInFlight) * MaxZeroCopyHeader];
+			slot[0] = (unsigned char)(protocolId >> 24);
+			slot[1] = (unsigned char)((protocolId >> 16) & 0xFF);
+			slot[2] = (unsigned char)((protocolId >> 8) & 0xFF);
+			slot[3] = (unsigned char)((protocolId) & 0xFF);
+			if (headerSize > 0)
+				std::memcpy(slot + 4, header, headerSize);
+			if (socket.SendZeroCopy(address, slot, headerSize + 4, data, size, id))
+				return true;
+			// every slot may be in flight, retire what has completed and try once more
+			if (socket.PollCompletions() == 0)
+				return false;
+			return socket.SendZeroCopy(address, slot, headerSize + 4, data, size, id);
+		}
+
+	private:
+
+		// transmit time for the next datagram of size bytes under PacingTxTime, zero to send immediately
+		//  + continues the schedule across batches, but never schedules into the past
+
+		long long NextTransmitTime(int size)
+		{
+			if (pacing != PacingTxTime || pacingRate <= 0)
+				return 0;
+			const long long now = monotonic_now();
+			if (nextTransmitTime < now)
+				nextTransmitTime = now;
+			const long long transmitTime = nextTransmitTime;
+			nextTransmitTime += (long long)size * 1000000000LL / pacingRate;
+			return transmitTime;
+		}
+
+		enum
+		{
+			MaxZeroCopyHeader = 32,			// bytes reserved per zero copy send for protocol id and reliability header
+			MaxProbes = 3,					// losses before a probe size counts as too big (DPLPMTUD MAX_PROBES)
+			ProbeGranularity = 8			// the search stops once the remaining range is smaller than this
+		};
+
+		// next datagram from the coalesced receive buffer, refilled from the socket when exhausted
+
+		const unsigned char* NextSegment(Address& sender, int& bytes_read)
+		{
+			if (offloadOffset >= offloadSize)
+			{
+				offloadOffset = 0;
+				offloadSize = socket.ReceiveSegmented(offloadSender, &offloadBuffer[0], MaxOffloadSize, offloadSegment);
+				offloadTime = socket.GetReceiveTime();
+				if (offloadSize <= 0)
+				{
+					offloadSize = 0;
+					bytes_read = 0;
+					return NULL;
+				}
+			}
+			const unsigned char* segment = &offloadBuffer[offloadOffset];
+			bytes_read = offloadSize - offloadOffset < offloadSegment ? offloadSize - offloadOffset : offloadSegment;
+			offloadOffset += bytes_read;
+			sender = offloadSender;
+			return segment;
+		}
+
+		void Accept(const Address& sender)
+		{
+			printf("server accepts connection from client %d.%d.%d.%d:%d\n",
+				sender.GetA(), sender.GetB(), sender.GetC(), sender.GetD(), sender.GetPort());
+			state = Connected;
+			address = sender;
+			if (connected_socket)
+				transport->Connect(sender);
+			OnConnect();
+		}
+
+		// client side of the handshake: a ConnectRequest until the server hands out a cookie, then the cookie
+
+		void SendHandshake()
+		{
+			unsigned char packet[MaxControlSize];
+			memset(packet, 0, sizeof(packet));
+			write_control(packet, protocolId, haveCookie ? ConnectResponse : ConnectRequest, offeredOptions);
+			if (haveCookie)
+				memcpy(packet + ControlHeaderSize, cookie, CookieSize);
+			transport->Send(address, packet, MaxControlSize);
+			handshakeTimer = 0.0f;
+		}
+
+		void ProcessHandshake(const Address& sender, const unsigned char packet[], int bytes_read)
+		{
+			const int type = packet[4];
+			if (mode == Server && handshake && bytes_read >= MaxControlSize)
+			{
+				if (type == ConnectRequest)
+				{
+					// stateless: answer with a cookie for the sender's address and forget about it
+					unsigned char reply[MaxControlSize];
+					write_control(reply, protocolId, ConnectChallenge, MaxControlSize);
+					cookies.Write(reply + ControlHeaderSize, sender, protocolId);
+					transport->Send(sender, reply, MaxControlSize);
+				}
+				else if (type == ConnectResponse && cookies.Check(packet + ControlHeaderSize, sender, protocolId))
+				{
+					if (!IsConnected())
+					{
+						options = (((unsigned int)packet[5] << 8) | packet[6]) & offeredOptions;
+						Accept(sender);
+					}
+					// accepts are repeated for retried responses, whose accept may have been lost
+					if (sender == address)
+					{
+						timeoutAccumulator = 0.0f;
+						unsigned char reply[ControlHeaderSize];
+						write_control(reply, protocolId, ConnectAccept, options);
+						transport->Send(sender, reply, ControlHeaderSize);
+					}
+				}
+			}
+			else if (mode == Client && handshake && state == Connecting && sender == address)
+			{
+				if (type == ConnectChallenge && bytes_read >= MaxControlSize)
+				{
+					memcpy(cookie, packet + ControlHeaderSize, CookieSize);
+					haveCookie = true;
+					SendHandshake();
+				}
+				else if (type == ConnectAccept)
+				{
+					printf("client completes connection with server\n");
+					options = (((unsigned int)packet[5] << 8) | packet[6]) & offeredOptions;
+					state = Connected;
+					timeoutAccumulator = 0.0f;
+					OnConnect();
+				}
+			}
+		}
+
+		void ProcessControl(const Address& sender, const unsigned char packet[], int bytes_read)
+		{
+			const int type = packet[4];
+			if (type >= ConnectRequest && type <= ConnectAccept)
+			{
+				ProcessHandshake(sender, packet, bytes_read);
+				return;
+			}
+			if (sender != address)
+				return;
+			const int size = ((int)packet[5] << 8) | packet[6];
+			if (type == ProbeRequest)
+			{
+				// echo the size that actually arrived, the prober only accepts its full probe size
+				unsigned char reply[ControlHeaderSize];
+				write_control(reply, protocolId, ProbeReply, bytes_read);
+				transport->Send(address, reply, ControlHeaderSize);
+			}
+			else if (type == ProbeReply && discovery && probeSize != 0 && size == probeSize)
+			{
+				pathMtu = probeSize;
+				probeLow = probeSize;
+				probeSize = 0;
+			}
+		}
+
+		// one step of the path mtu search: the ceiling is probed first, then a binary search between the
+		// confirmed size and the largest size not yet shown to fail, MaxProbes losses fail a size
+
+		void UpdateDiscovery(float deltaTime)
+		{
+			if (searchComplete)
+			{
+				raiseTimer += deltaTime;
+				if (raiseTimer < ProbeRaiseTime)
+					return;
+				searchComplete = false;
+				probeLow = pathMtu;
+				probeHigh = 0;
+			}
+			if (probeHigh == 0)
+			{
+				probeHigh = maxPacketSize;
+				const int routeMtu = transport == &socket ? socket.GetRouteMtu() : 0;
+				if (routeMtu > 28 && routeMtu - 28 < probeHigh)
+					probeHigh = routeMtu - 28;		// ip and udp headers
+				if (probeHigh > probeLow)
+				{
+					probeSize = probeHigh;
+					probeCount = 0;
+					SendProbe();
+					return;
+				}
+			}
+			if (probeSize != 0)
+			{
+				probeTimer += deltaTime;
+				if (probeTimer < ProbeTimeout)
+					return;
+				if (++probeCount < MaxProbes)
+				{
+					SendProbe();
+					return;
+				}
+				probeHigh = probeSize - 1;
+				probeSize = 0;
+			}
+			if (probeHigh - probeLow < ProbeGranularity)
+			{
+				printf("path mtu %d bytes\n", pathMtu);
+				searchComplete = true;
+				raiseTimer = 0.0f;
+				return;
+			}
+			probeSize = (probeLow + probeHigh + 1) / 2;
+			probeCount = 0;
+			SendProbe();
+		}
+
+		// a lost probe and a probe the local stack refused (too big for the interface) are treated alike
+
+		void SendProbe()
+		{
+			unsigned char* packet = &packetBuffer[0];
+			write_control(packet, protocolId, ProbeRequest, probeSize);
+			memset(packet + ControlHeaderSize, 0, probeSize - ControlHeaderSize);
+			probeTimer = 0.0f;
+			transport->Send(address, packet, probeSize);
+		}
+
+		void ResetDiscovery()
+		{
+			pathMtu = BasePacketSize < maxPacketSize ? BasePacketSize : maxPacketSize;
+			probeLow = pathMtu;
+			probeHigh = 0;
+			probeSize = 0;
+			probeCount = 0;
+			probeTimer = 0.0f;
+			searchComplete = false;
+			raiseTimer = 0.0f;
+		}
+
+		void ClearData()
+		{
+			state = Disconnected;
+			timeoutAccumulator = 0.0f;
+			address = Address();
+			transport->Disconnect();
+			offloadSize = 0;
+			offloadOffset = 0;
+			offloadTime = 0;
+			receiveTime = 0;
+			ResetDiscovery();
+			haveCookie = false;
+			handshakeTimer = HandshakeRetryTime;
+			options = 0;
+		}
+
+		enum State
+		{
+			Disconnected,
+			Listening,
+			Connecting,
+			ConnectFail,
+			Connected
+		};
+
+		unsigned int protocolId;
+		float timeout;
+
+		bool running;
+		bool connected_socket;
+		Mode mode;
+		State state;
+		Socket socket;
+		Transport* transport;						// datagram io goes through here, normally &socket
+		Pacing pacing;
+		int pacingRate;								// bytes per second, zero when unpaced
+		long long nextTransmitTime;					// monotonic time the next PacingTxTime datagram may leave
+		float timeoutAccumulator;
+		Address address;
+
+		std::vector<unsigned char> offloadBuffer;	// coalesced (GRO) receive buffer
+		std::vector<unsigned char> offloadSendBuffer;	// super-buffer handed to the kernel for GSO
+		int offloadSize;							// bytes held in offloadBuffer
+		int offloadOffset;							// read position of the next segment in offloadBuffer
+		int offloadSegment;							// size of each segment in offloadBuffer
+		Address offloadSender;						// sender of the coalesced datagrams
+		long long offloadTime;						// kernel receive time of the coalesced datagrams
+		long long receiveTime;						// kernel receive time of the last packet returned by ReceivePacket
+		std::vector<unsigned char> zeroCopyHeaders;	// header slots of in flight zero copy sends
+
+		int maxPacketSize;							// largest datagram sent or received, sizes the buffers below
+		std::vector<unsigned char> packetBuffer;	// one datagram, for single sends and receives
+		std::vector<unsigned char> batchBuffer;		// MaxPacketBatch datagrams, for SendPackets and ReceivePackets
+
+		bool discovery;								// path mtu discovery enabled
+		int pathMtu;								// largest datagram confirmed to reach the peer
+		int probeLow;								// search range: confirmed size ...
+		int probeHigh;								// ... up to the largest size not shown to fail, zero before a search starts
+		int probeSize;								// size of the outstanding probe, zero if none
+		int probeCount;								// times the outstanding probe size has been sent
+		float probeTimer;							// time since the outstanding probe was sent
+		bool searchComplete;
+		float raiseTimer;							// time since the last search completed
+
+		bool handshake;								// stateless connect handshake enabled
+		CookieSecret cookies;						// server: issues and checks connect cookies
+		unsigned char cookie[CookieSize];			// client: cookie handed out by the server
+		bool haveCookie;
+		float handshakeTimer;						// client: time since the last handshake packet
+		unsigned int offeredOptions;				// options this end supports, see ConnectOption
+		unsigned int options;						// options agreed for the current connection
+	};
+
+	// sequence ordering: s1 is more recent than s2 if it is ahead by no more than half the sequence space
+	//  + this works provided there is a large gap when sequence wrap occurs
+
+	inline bool sequence_more_recent(unsigned int s1, unsigned int s2, unsigned int max_sequence)
+	{
+		auto half_max = max_sequence / 2;
+		return (
+			((s1 > s2) && (s1 - s2 <= half_max))
+			||
+			((s2 > s1) && (s2 - s1 > half_max))
+			);
+	}
+
+	// how far newer is ahead of older, with sequences wrapping after max_sequence
+
+	inline unsigned int sequence_difference(unsigned int newer, unsigned int older, unsigned int max_sequence)
+	{
+		return newer >= older ? newer - older : newer + (max_sequence - older) + 1;
+	}
+
+	// the sequence count places before sequence
+
+	inline unsigned int sequence_before(unsigned int sequence, unsigned int count, unsigned int max_sequence)
+	{
+		return sequence >= count ? sequence - count : max_sequence - (count - sequence) + 1;
+	}
+
+	// index of the highest set bit of a non zero value, for walking just the set bits of a bitfield
+
+	inline int highest_bit(unsigned int value)
+	{
+		assert(value != 0);
+#if PLATFORM == PLATFORM_WINDOWS
+		unsigned long index;
+		_BitScanReverse(&index, value);
+		return (int)index;
+#else
+		return 31 - __builtin_clz(value);
+#endif
+	}
+
+	inline int highest_bit(unsigned long long value)
+	{
+		const unsigned int high = (unsigned int)(value >> 32);
+		return high ? 32 + highest_bit(high) : highest_bit((unsigned int)value);
+	}
+
+	// sequence buffer: per packet state for the most recent sequence numbers, in a power of two ring indexed by sequence
+	//  + insert, find and remove are O(1) and the entries contiguous, with no allocation once the ring is big enough
+	//  + inserting a sequence ahead of the most recent clears the entries it skips, so a lap old entry never shows up
+	//    as present, and inserting one a whole ring behind the most recent fails
+	//  + slots are found by masking the sequence when max_sequence + 1 is a power of two no smaller than the capacity
+	//    (the default 2^32 wrap). any other wrap counts positions on from the most recent insert, see Position
+
+	template <typename T> class SequenceBuffer
+	{
+	public:
+
+		SequenceBuffer(int capacity, unsigned int max_sequence = 0xFFFFFFFF)
+		{
+			assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+			this->max_sequence = max_sequence;
+			wraps_evenly = ((max_sequence + 1) & max_sequence) == 0;
+			assert(!wraps_evenly || max_sequence == 0xFFFFFFFF || (unsigned int)capacity <= max_sequence + 1);
+			tags.resize(capacity);
+			entries.resize(capacity);
+			Clear();
+		}
+
+		void Clear()
+		{
+			std::fill(tags.begin(), tags.end(), 0);
+			latest = 0;
+			position = 0;
+			empty = true;
+		}
+
+		int GetCapacity() const
+		{
+			return (int)tags.size();
+		}
+
+		// one past the most recent sequence inserted, zero while empty
+
+		unsigned int GetSequence() const
+		{
+			return empty ? 0 : (latest == max_sequence ? 0 : latest + 1);
+		}
+
+		// the entry for sequence, to be filled in by the caller, NULL if sequence is a whole ring behind the most recent
+
+		T* Insert(unsigned int sequence)
+		{
+			const unsigned long long at = Position(sequence);
+			if (empty || sequence_more_recent(sequence, latest, max_sequence))
+			{
+				const unsigned int skipped = empty ? 0 : sequence_difference(sequence, latest, max_sequence) - 1;
+				if (skipped >= tags.size())
+					std::fill(tags.begin(), tags.end(), 0);
+				else
+				{
+					for (unsigned int i = 1; i <= skipped; ++i)
+						tags[(position + i) & (tags.size() - 1)] = 0;
+				}
+				latest = sequence;
+				position = at;
+				empty = false;
+			}
+			else if (sequence_difference(latest, sequence, max_sequence) >= tags.size())
+				return NULL;
+			const size_t index = at & (tags.size() - 1);
+			tags[index] = at + 1;
+			return &entries[index];
+		}
+
+		void Remove(unsigned int sequence)
+		{
+			const unsigned long long at = Position(sequence);
+			const size_t index = at & (tags.size() - 1);
+			if (tags[index] == at + 1)
+				tags[index] = 0;
+		}
+
+		bool Exists(unsigned int sequence) const
+		{
+			const unsigned long long at = Position(sequence);
+			return tags[at & (tags.size() - 1)] == at + 1;
+		}
+
+		T* Find(unsigned int sequence)
+		{
+			const unsigned long long at = Position(sequence);
+			const size_t index = at & (tags.size() - 1);
+			return tags[index] == at + 1 ? &entries[index] : NULL;
+		}
+
+		const T* Find(unsigned int sequence) const
+		{
+			const unsigned long long at = Position(sequence);
+			const size_t index = at & (tags.size() - 1);
+			return tags[index] == at + 1 ? &entries[index] : NULL;
+		}
+
+		// double the capacity, keeping every entry
+
+		void Grow()
+		{
+			assert(!wraps_evenly || max_sequence == 0xFFFFFFFF || tags.size() * 2 <= (size_t)max_sequence + 1);
+			std::vector<unsigned long long> oldTags(tags.size() * 2, 0);
+			std::vector<T> oldEntries(entries.size() * 2);
+			oldTags.swap(tags);
+			oldEntries.swap(entries);
+			for (size_t i = 0; i < oldTags.size(); ++i)
+			{
+				if (oldTags[i] == 0)
+					continue;
+				const size_t index = (size_t)(oldTags[i] - 1) & (tags.size() - 1);
+				tags[index] = oldTags[i];
+				entries[index] = oldEntries[i];
+			}
+		}
+
+	private:
+
+		// where sequence falls in a count that never wraps, so consecutive sequences take consecutive slots
+		//  + the sequence itself when the sequence space is a power of two, the mask then wraps with it
+		//  + otherwise counted from the position of the most recent insert, which starts a lap up so
+		//    positions of older sequences stay above zero
+
+		unsigned long long Position(unsigned int sequence) const
+		{
+			if (wraps_evenly)
+				return sequence;
+			if (empty)
+				return (unsigned long long)sequence + max_sequence + 1;
+			if (sequence_more_recent(sequence, latest, max_sequence))
+				return position + sequence_difference(sequence, latest, max_sequence);
+			return position - sequence_difference(latest, sequence, max_sequence);
+		}
+
+		unsigned int max_sequence;
+		bool wraps_evenly;							// max_sequence + 1 is a power of two (or 2^32), positions are sequences
+		unsigned int latest;						// most recent sequence inserted
+		unsigned long long position;				// position of latest, see Position
+		bool empty;									// nothing inserted since the last clear
+		std::vector<unsigned long long> tags;		// position + 1 of the entry held in each slot, zero for none
+		std::vector<T> entries;
+	};
+
+	// sliding window byte and packet counter on the reliability clock
+	//  + totals are kept per bucket in a ring of Buckets intervals spanning the window. adding or advancing
+	//    retires only the buckets that fell out of the window, so the window total costs O(1) per update
+	//  + the window reaches back Buckets - 1 whole intervals plus the current partial one
+
+	class WindowCounter
+	{
+	public:
+
+		enum { Buckets = 16 };
+
+		WindowCounter()
+		{
+			SetWindow(1000000);
+		}
+
+		// window length in microseconds, clears the counter
+
+		void SetWindow(long long window)
+		{
+			assert(window >= Buckets);
+			width = window / Buckets;
+			Clear();
+		}
+
+		long long GetWindow() const
+		{
+			return width * Buckets;
+		}
+
+		void Clear()
+		{
+			for (int i = 0; i < Buckets; ++i)
+			{
+				bytes[i] = 0;
+				packets[i] = 0;
+			}
+			total_bytes = 0;
+			total_packets = 0;
+			current = 0;
+			last = 0;
+			newest = -1;
+		}
+
+		void Add(long long time, int size)
+		{
+			Advance(time);
+			bytes[current % Buckets] += size;
+			packets[current % Buckets]++;
+			total_bytes += size;
+			total_packets++;
+			newest = current;
+		}
+
+		void Advance(long long time)
+		{
+			if (time < last)
+				return;
+			last = time;
+			const long long bucket = time / width;
+			if (bucket - current >= Buckets)
+				current = bucket - Buckets;
+			while (current < bucket)
+			{
+				const int index = (int)(++current % Buckets);
+				total_bytes -= bytes[index];
+				total_packets -= packets[index];
+				bytes[index] = 0;
+				packets[index] = 0;
+			}
+		}
+
+		long long GetBytes() const
+		{
+			return total_bytes;
+		}
+
+		int GetPackets() const
+		{
+			return total_packets;
+		}
+
+		// bytes per second over the span the window covers as of the last advance
+
+		float GetRate() const
+		{
+			const long long span = (Buckets - 1) * width + last - current * width + 1;
+			return total_bytes * 1000000.0f / span;
+		}
+
+		// time at which everything counted so far has left the window, negative when empty
+
+		long long GetDrainTime() const
+		{
+			if (total_packets == 0)
+				return -1;
+			return (newest + Buckets) * width;
+		}
+
+	private:
+
+		long long width;					// bucket interval in microseconds
+		long long current;					// index of the bucket holding last, counted from time zero
+		long long last;						// most recent time added or advanced to
+		long long newest;					// bucket of the most recent add
+		long long total_bytes;
+		int total_packets;
+		long long bytes[Buckets];
+		int packets[Buckets];
+	};
+
+	// ack bits: bit i acks the packet i + 1 before the ack, up to MaxAckBits of them in 64 bit words
+	//  + the receiver keeps them as a shifting bitset, moved up as newer packets arrive and set as packets
+	//    come in, so sending an ack copies a few words rather than looking up every packet it covers
+	//  + the wire carries only the width agreed for the connection, bits past it are zero on receipt
+
+	struct AckBits
+	{
+		enum { Words = MaxAckBits / 64 };
+
+		unsigned long long words[Words];
+
+		void Clear()
+		{
+			for (int i = 0; i < Words; ++i)
+				words[i] = 0;
+		}
+
+		bool Test(int index) const
+		{
+			return ((words[index >> 6] >> (index & 63)) & 1) != 0;
+		}
+
+		void Set(int index)
+		{
+			words[index >> 6] |= 1ull << (index & 63);
+		}
+
+		// bits move up count places, those moved past MaxAckBits are dropped and the lowest count bits clear
+
+		void Shift(unsigned int count)
+		{
+			const int word_shift = count < MaxAckBits ? (int)(count >> 6) : Words;
+			const int bit_shift = (int)(count & 63);
+			for (int i = Words - 1; i >= 0; --i)
+			{
+				const int from = i - word_shift;
+				unsigned long long word = 0;
+				if (from >= 0)
+				{
+					word = words[from] << bit_shift;
+					if (bit_shift && from > 0)
+						word |= words[from - 1] >> (64 - bit_shift);
+				}
+				words[i] = word;
+			}
+		}
+
+		// bits 8 * index to 8 * index + 7, and 32 * index to 32 * index + 31
+
+		unsigned char GetByte(int index) const
+		{
+			return (unsigned char)((words[index >> 3] >> ((index & 7) * 8)) & 0xFF);
+		}
+
+		void SetByte(int index, unsigned char value)
+		{
+			const int shift = (index & 7) * 8;
+			words[index >> 3] = (words[index >> 3] & ~(0xFFull << shift)) | ((unsigned long long)value << shift);
+		}
+
+		unsigned int GetWord(int index) const
+		{
+			return (unsigned int)(words[index >> 1] >> ((index & 1) * 32));
+		}
+
+		void SetWord(int index, unsigned int value)
+		{
+			const int shift = (index & 1) * 32;
+			words[index >> 1] = (words[index >> 1] & ~(0xFFFFFFFFull << shift)) | ((unsigned long long)value << shift);
+		}
+	};
+
+	// what the reliability system keeps per sent and received packet
+
+	struct SentPacketData
+	{
+		long long time;					// reliability clock time the packet was sent, see ReliabilitySystem::GetTime
+		int size;						// packet size in bytes
+		long long timestamp;			// wall clock send time in nanoseconds (see timestamp_now), zero if not recorded
+		bool acked;
+	};
+
+	struct ReceivedPacketData
+	{
+		int size;						// packet size in bytes
+	};
+
+	// reliability system to support reliable connection
+	//  + keeps sent and received packets in sequence buffers: sent packets for acks, loss and bandwidth,
+	//    received packets for duplicate detection. the ack bits are kept up to date as packets arrive
+	//  + runs on its own monotonic clock in integer microseconds, advanced by Update. packets are stamped with it
+	//    and aged on demand, so an update costs only the packets that expire in it
+	//  + sent and acked bandwidth come from window counters bumped on send and ack, over a configurable window
+	//  + separated out from reliable connection because it is quite complex and i want to unit test it!
+
+	class ReliabilitySystem
+	{
+	public:
+
+		// any max_sequence works, though ack bits only cover what the rings hold: with fewer than 1024 sequences
+		// the rings shrink to the largest power of two within half the sequence space
+
+		ReliabilitySystem(unsigned int max_sequence = 0xFFFFFFFF)
+			: sentPackets(RingCapacity(SentPacketsCapacity, max_sequence), max_sequence),
+			  receivedPackets(RingCapacity(ReceivedPacketsCapacity, max_sequence), max_sequence)
+		{
+			this->max_sequence = max_sequence;
+			Reset();
+		}
+
+		void Reset()
+		{
+			local_sequence = 0;
+			remote_sequence = 0;
+			sentPackets.Clear();
+			receivedPackets.Clear();
+			ack_bits.Clear();
+			pending_start = 0;
+			time = 0;
+			sentWindow.Clear();
+			ackedWindow.Clear();
+			sent_packets = 0;
+			recv_packets = 0;
+			lost_packets = 0;
+			acked_packets = 0;
+			sent_bandwidth = 0.0f;
+			acked_bandwidth = 0.0f;
+			rtt = 0.0f;
+			rtt_maximum = 1.0f;
+		}
+
+		void PacketSent(int size)
+		{
+			// the ring must keep every packet sent in the last rtt_maximum, grow it to the send rate
+			//  + but not past half the sequence space, beyond which sequence ordering breaks down
+			const unsigned int pending = sequence_difference(local_sequence, pending_start, max_sequence);
+			if (pending >= max_sequence / 2)
+				DropOldestSent();
+			else if (pending >= (unsigned int)sentPackets.GetCapacity())
+				sentPackets.Grow();
+			SentPacketData* packet = sentPackets.Insert(local_sequence);
+			assert(packet);
+			packet->time = time;
+			packet->size = size;
+			packet->timestamp = timestamp_now();
+			packet->acked = false;
+			sentWindow.Add(time, size);
+			sent_packets++;
+			local_sequence++;
+			if (local_sequence > max_sequence)
+				local_sequence = 0;
+		}
+
+		void PacketReceived(unsigned int sequence, int size)
+		{
+			recv_packets++;
+			if (receivedPackets.Exists(sequence))
+				return;
+			ReceivedPacketData* packet = receivedPackets.Insert(sequence);
+			if (!packet)
+				return;
+			packet->size = size;
+			// a newer packet moves the ack bits up behind it, with the previous remote sequence as bit
+			// difference - 1, an older one sets its own bit
+			if (sequence_more_recent(sequence, remote_sequence, max_sequence))
+			{
+				const unsigned int difference = sequence_difference(sequence, remote_sequence, max_sequence);
+				const bool previous = receivedPackets.Exists(remote_sequence);
+				ack_bits.Shift(difference);
+				if (previous && difference <= MaxAckBits)
+					ack_bits.Set(difference - 1);
+				remote_sequence = sequence;
+			}
+			else if (sequence != remote_sequence)
+			{
+				const unsigned int difference = sequence_difference(remote_sequence, sequence, max_sequence);
+				if (difference <= MaxAckBits)
+					ack_bits.Set(difference - 1);
+			}
+		}
+
+		// ack bits for the remote sequence, the caller sends as many of them as the connection agreed on
+
+		const AckBits& GetAckBits() const
+		{
+			return ack_bits;
+		}
+
+		// receive_time is the kernel receive timestamp of the packet carrying the ack (zero if unknown),
+		// when present rtt samples are measured against it rather than the reliability clock
+
+		void ProcessAck(unsigned int ack, const AckBits& ack_bits, long long receive_time = 0)
+		{
+			// only packets sent within the last rtt_maximum can be acked, older ones have counted as lost
+			//  + so drop the bits reaching back past pending_start, then walk just the set bits, oldest first,
+			//    and the ack itself: the cost is in packets acked, not in flight
+			const unsigned int pending = sequence_difference(local_sequence, pending_start, max_sequence);
+			const unsigned int reach = sequence_difference(ack, pending_start, max_sequence);
+			if (reach >= pending)
+				return;
+			for (int word_index = AckBits::Words - 1; word_index >= 0; --word_index)
+			{
+				const unsigned int first = (unsigned int)word_index * 64;
+				if (reach <= first)
+					continue;
+				unsigned long long word = ack_bits.words[word_index];
+				if (reach - first < 64)
+					word &= (1ull << (reach - first)) - 1;
+				while (word)
+				{
+					const int bit_index = highest_bit(word);
+					word &= ~(1ull << bit_index);
+					AckPacket(sequence_before(ack, first + bit_index + 1, max_sequence), receive_time);
+				}
+			}
+			AckPacket(ack, receive_time);
+		}
+
+		void Update(float deltaTime)
+		{
+			acks.clear();
+			time += (long long)(deltaTime * 1000000.0f + 0.5f);
+			UpdateQueues();
+			UpdateStats();
+#ifdef NET_UNIT_TEST
+			Validate();
+#endif
+		}
+
+		void Validate()
+		{
+			// every packet sent since pending_start is there, oldest first
+			const unsigned int pending = sequence_difference(local_sequence, pending_start, max_sequence);
+			assert(pending <= (unsigned int)sentPackets.GetCapacity());
+			unsigned int sequence = pending_start;
+			long long previous = 0;
+			for (unsigned int i = 0; i < pending; ++i)
+			{
+				const SentPacketData* packet = sentPackets.Find(sequence);
+				assert(packet);
+				assert(packet->time >= previous && packet->time <= time);
+				previous = packet->time;
+				sequence = sequence == max_sequence ? 0 : sequence + 1;
+			}
+
+			// the ack bits kept up to date match those looked up packet by packet, as far back as packets are kept
+			AckBits expected;
+			const int bits = receivedPackets.GetCapacity() - 1 < MaxAckBits ? receivedPackets.GetCapacity() - 1 : MaxAckBits;
+			generate_ack_bits(remote_sequence, receivedPackets, max_sequence, bits, expected);
+			for (int bit_index = 0; bit_index < bits; ++bit_index)
+				assert(ack_bits.Test(bit_index) == expected.Test(bit_index));
+		}
+
+		// utility functions
+
+		static void generate_ack_bits(unsigned int ack, const SequenceBuffer<ReceivedPacketData>& received_packets, unsigned int max_sequence,
+			int bits, AckBits& ack_bits)
+		{
+			ack_bits.Clear();
+			for (int bit_index = 0; bit_index < bits; ++bit_index)
+			{
+				if (received_packets.Exists(sequence_before(ack, bit_index + 1, max_sequence)))
+					ack_bits.Set(bit_index);
+			}
+		}
+
+		// data accessors
+
+		unsigned int GetLocalSequence() const
+		{
+			return local_sequence;
+		}
+
+		unsigned int GetRemoteSequence() const
+		{
+			return remote_sequence;
+		}
+
+		unsigned int GetMaxSequence() const
+		{
+			return max_sequence;
+		}
+
+		void GetAcks(unsigned int** acks, int& count)
+		{
+			*acks = &this->acks[0];
+			count = (int)this->acks.size();
+		}
+
+		unsigned int GetSentPackets() const
+		{
+			return sent_packets;
+		}
+
+		unsigned int GetReceivedPackets() const
+		{
+			return recv_packets;
+		}
+
+		unsigned int GetLostPackets() const
+		{
+			return lost_packets;
+		}
+
+		unsigned int GetAckedPackets() const
+		{
+			return acked_packets;
+		}
+
+		float GetSentBandwidth() const
+		{
+			return sent_bandwidth;
+		}
+
+		float GetAckedBandwidth() const
+		{
+			return acked_bandwidth;
+		}
+
+		float GetRoundTripTime() const
+		{
+			return rtt;
+		}
+
+		// window the sent and acked bandwidth are measured over, one second (rtt_maximum) by default.
+		// shorter windows react faster to rate changes, at a coarser granularity of window / 16
+
+		void SetBandwidthWindow(float seconds)
+		{
+			const long long window = (long long)(seconds * 1000000.0f + 0.5f);
+			sentWindow.SetWindow(window);
+			ackedWindow.SetWindow(window);
+			UpdateStats();
+		}
+
+		float GetBandwidthWindow() const
+		{
+			return sentWindow.GetWindow() / 1000000.0f;
+		}
+
+		// the reliability clock: microseconds of deltaTime passed to Update since the last reset
+
+		long long GetTime() const
+		{
+			return time;
+		}
+
+		// seconds until Update next drops a sent packet from the ack window (counting a loss if it is unacked)
+		// or the bandwidth windows run empty, negative when there is nothing left to expire.
+		// lets idle connections skip Update until then
+
+		float GetNextExpiry() const
+		{
+			long long expiry = -1;
+			if (pending_start != local_sequence)
+				expiry = sentPackets.Find(pending_start)->time + GetPendingTime();
+			const long long drains[2] = { sentWindow.GetDrainTime(), ackedWindow.GetDrainTime() };
+			for (int i = 0; i < 2; ++i)
+			{
+				if (drains[i] >= 0 && (expiry < 0 || drains[i] < expiry))
+					expiry = drains[i];
+			}
+			if (expiry < 0)
+				return -1.0f;
+			return expiry > time ? (expiry - time) / 1000000.0f : 0.0f;
+		}
+
+	protected:
+
+		// how long a sent packet stays ackable in microseconds, just over rtt_maximum
+
+		long long GetPendingTime() const
+		{
+			return (long long)(rtt_maximum * 1000000.0f) + 1000;
+		}
+
+		void UpdateQueues()
+		{
+			// unacked packets older than rtt_maximum are lost
+			const long long pending_limit = time - GetPendingTime();
+			while (pending_start != local_sequence && sentPackets.Find(pending_start)->time < pending_limit)
+				DropOldestSent();
+		}
+
+		void UpdateStats()
+		{
+			sentWindow.Advance(time);
+			ackedWindow.Advance(time);
+			sent_bandwidth = sentWindow.GetRate() * (8 / 1000.0f);
+			acked_bandwidth = ackedWindow.GetRate() * (8 / 1000.0f);
+		}
+
+		// a pending sent packet acked, see ProcessAck
+
+		void AckPacket(unsigned int sequence, long long receive_time)
+		{
+			SentPacketData* packet = sentPackets.Find(sequence);
+			if (!packet || packet->acked)
+				return;
+			float sample = (time - packet->time) / 1000000.0f;
+			if (receive_time != 0 && packet->timestamp != 0 && receive_time > packet->timestamp)
+				sample = (float)((receive_time - packet->timestamp) / 1000000000.0);
+			rtt += (sample - rtt) * 0.1f;
+			packet->acked = true;
+			ackedWindow.Add(time, packet->size);
+			acks.push_back(sequence);
+			acked_packets++;
+		}
+
+		// the oldest sent packet leaves the ack window, counting as lost if it was never acked
+
+		void DropOldestSent()
+		{
+			if (!sentPackets.Find(pending_start)->acked)
+				lost_packets++;
+			sentPackets.Remove(pending_start);
+			pending_start = pending_start == max_sequence ? 0 : pending_start + 1;
+		}
+
+	private:
+
+		enum
+		{
+			SentPacketsCapacity = 256,		// grows with the send rate, see PacketSent
+			ReceivedPacketsCapacity = 512	// covers the MaxAckBits + 1 packets acked by each ack and ack bits
+		};
+
+		// a power of two ring capacity, halved until the ring holds no more than half the sequence space,
+		// so a received packet a lap old never passes for a duplicate
+
+		static int RingCapacity(int capacity, unsigned int max_sequence)
+		{
+			const unsigned int half = max_sequence / 2 + 1;
+			while ((unsigned int)capacity > half)
+				capacity /= 2;
+			return capacity;
+		}
+
+		unsigned int max_sequence;			// maximum sequence value before wrap around (used to test sequence wrap at low # values)
+		unsigned int local_sequence;		// local sequence number for most recently sent packet
+		unsigned int remote_sequence;		// remote sequence number for most recently received packet
+
+		unsigned int sent_packets;			// total number of packets sent
+		unsigned int recv_packets;			// total number of packets received
+		unsigned int lost_packets;			// total number of packets lost
+		unsigned int acked_packets;			// total number of packets acked
+
+		float sent_bandwidth;				// approximate sent bandwidth over the bandwidth window
+		float acked_bandwidth;				// approximate bandwidth acked over the bandwidth window
+		float rtt;							// estimated round trip time
+		float rtt_maximum;					// maximum expected round trip time (hard coded to one second for the moment)
+		long long time;						// reliability clock in microseconds
+
+		std::vector<unsigned int> acks;		// acked packets from last set of packet receives. cleared each update!
+
+		SequenceBuffer<SentPacketData> sentPackets;				// packets sent from pending_start on
+		SequenceBuffer<ReceivedPacketData> receivedPackets;		// the most recent packets received
+		AckBits ack_bits;					// bit i: remote_sequence - (i + 1) received
+		unsigned int pending_start;			// oldest packet sent within rtt_maximum: still ackable
+		WindowCounter sentWindow;			// bytes sent, by send time
+		WindowCounter ackedWindow;			// bytes acked, by ack time
+	};
+
+	// reliability header: sequence, ack and the ack bits 32 at a time, lowest first, as big endian 32 bit integers
+	//  + 12 bytes with the default 32 ack bits, ReliabilityHeaderMaxSize with MaxAckBits
+
+	inline int reliability_header_size(int ack_bits_width)
+	{
+		return 8 + ack_bits_width / 8;
+	}
+
+	inline void write_big_endian(unsigned char* data, unsigned int value)
+	{
+		data[0] = (unsigned char)(value >> 24);
+		data[1] = (unsigned char)((value >> 16) & 0xFF);
+		data[2] = (unsigned char)((value >> 8) & 0xFF);
+		data[3] = (unsigned char)(value & 0xFF);
+	}
+
+	inline unsigned int read_big_endian(const unsigned char* data)
+	{
+		return (((unsigned int)data[0] << 24) | ((unsigned int)data[1] << 16) | ((unsigned int)data[2] << 8) | ((unsigned int)data[3]));
+	}
+
+	inline void write_reliability_header(unsigned char* header, unsigned int sequence, unsigned int ack, const AckBits& ack_bits, int ack_bits_width)
+	{
+		write_big_endian(header, sequence);
+		write_big_endian(header + 4, ack);
+		for (int i = 0; i < ack_bits_width / 32; ++i)
+			write_big_endian(header + 8 + i * 4, ack_bits.GetWord(i));
+	}
+
+	inline void read_reliability_header(const unsigned char* header, unsigned int& sequence, unsigned int& ack, AckBits& ack_bits, int ack_bits_width)
+	{
+		sequence = read_big_endian(header);
+		ack = read_big_endian(header + 4);
+		ack_bits.Clear();
+		for (int i = 0; i < ack_bits_width / 32; ++i)
+			ack_bits.SetWord(i, read_big_endian(header + 8 + i * 4));
+	}
+
+	// compact reliability header: a flags byte, the low 16 bits of the sequence, the ack and the ack bits bytes that are not 0xFF
+	//  + flag bits 0-3 mark the first four ack bits bytes present, bit 4 an ack sent as a one byte difference behind
+	//    the sequence, otherwise the low 16 bits of the ack follow
+	//  + with ack bits wider than 32, flag bit 5 marks further ack bits bytes that are not 0xFF: after the first four
+	//    comes a mask with a bit for each further byte, then the bytes it marks
+	//  + the receiver extends sequence and ack to the values nearest the last sequence it received and the next it sends,
+	//    which takes sequence numbers that wrap at 2^32 or at most at 2^16 (see compact_header_supported)
+	//  + 4 bytes with no loss and acks close behind, compact_header_max_size at most, against 12 for the full header
+
+	inline bool compact_header_supported(unsigned int max_sequence)
+	{
+		return max_sequence == 0xFFFFFFFF || max_sequence <= 0xFFFF;
+	}
+
+	inline int compact_header_max_size(int ack_bits_width)
+	{
+		const int further = ack_bits_width / 8 - 4;
+		return 9 + (further > 0 ? (further + 7) / 8 + further : 0);
+	}
+
+	// returns the header size
+
+	inline int write_compact_header(unsigned char* header, unsigned int sequence, unsigned int ack, const AckBits& ack_bits, int ack_bits_width,
+		unsigned int max_sequence)
+	{
+		assert(compact_header_supported(max_sequence));
+		const unsigned int difference = sequence >= ack ? sequence - ack : sequence + (max_sequence - ack) + 1;
+		unsigned char flags = 0;
+		int size = 3;
+		header[1] = (unsigned char)((sequence >> 8) & 0xFF);
+		header[2] = (unsigned char)(sequence & 0xFF);
+		if (difference <= 0xFF)
+		{
+			flags |= 0x10;
+			header[size++] = (unsigned char)difference;
+		}
+		else
+		{
+			header[size++] = (unsigned char)((ack >> 8) & 0xFF);
+			header[size++] = (unsigned char)(ack & 0xFF);
+		}
+		for (int i = 0; i < 4; ++i)
+		{
+			const unsigned char byte = ack_bits.GetByte(i);
+			if (byte != 0xFF)
+			{
+				flags |= (unsigned char)(1 << i);
+				header[size++] = byte;
+			}
+		}
+		const int bytes = ack_bits_width / 8;
+		if (bytes > 4)
+		{
+			unsigned char* mask = header + size;
+			const int mask_size = (bytes - 4 + 7) / 8;
+			for (int i = 0; i < mask_size; ++i)
+				mask[i] = 0;
+			int extended = size + mask_size;
+			for (int i = 4; i < bytes; ++i)
+			{
+				const unsigned char byte = ack_bits.GetByte(i);
+				if (byte != 0xFF)
+				{
+					mask[(i - 4) >> 3] |= (unsigned char)(1 << ((i - 4) & 7));
+					header[extended++] = byte;
+				}
+			}
+			if (extended > size + mask_size)
+			{
+				flags |= 0x20;
+				size = extended;
+			}
+		}
+		header[0] = flags;
+		return size;
+	}
+
+	// the sequence with these low 16 bits nearest to reference
+
+	inline unsigned int extend_sequence(unsigned int low, unsigned int reference, unsigned int max_sequence)
+	{
+		if (max_sequence <= 0xFFFF)
+			return low;
+		return reference + (unsigned int)(int)(short)(unsigned short)(low - (reference & 0xFFFF));
+	}
+
+	// remote_sequence is the last sequence received, local_sequence the next one to send
+	//  + returns the header size, zero if bytes cannot hold the header or it does not decode
+
+	inline int read_compact_header(const unsigned char* header, int bytes, unsigned int& sequence, unsigned int& ack, AckBits& ack_bits,
+		int ack_bits_width, unsigned int remote_sequence, unsigned int local_sequence, unsigned int max_sequence)
+	{
+		if (bytes < CompactHeaderMinSize)
+			return 0;
+		const unsigned char flags = header[0];
+		if ((flags & 0xC0) || ((flags & 0x20) && ack_bits_width <= 32))
+			return 0;
+		int size = 3 + ((flags & 0x10) ? 1 : 2);
+		for (int i = 0; i < 4; ++i)
+			size += (flags >> i) & 1;
+		const int further = ack_bits_width / 8 - 4;
+		const int mask = size;
+		const int mask_size = (further + 7) / 8;
+		if (flags & 0x20)
+		{
+			size += mask_size;
+			if (bytes < size)
+				return 0;
+			for (int i = 0; i < further; ++i)
+				size += (header[mask + (i >> 3)] >> (i & 7)) & 1;
+		}
+		if (bytes < size)
+			return 0;
+		sequence = extend_sequence(((unsigned int)header[1] << 8) | header[2], remote_sequence, max_sequence);
+		int offset = 3;
+		if (flags & 0x10)
+		{
+			const unsigned int difference = header[offset++];
+			ack = sequence >= difference ? sequence - difference : max_sequence - (difference - sequence) + 1;
+		}
+		else
+		{
+			ack = extend_sequence(((unsigned int)header[offset] << 8) | header[offset + 1], local_sequence, max_sequence);
+			offset += 2;
+		}
+		if (sequence > max_sequence || ack > max_sequence)
+			return 0;
+		ack_bits.Clear();
+		for (int i = 0; i < 4; ++i)
+			ack_bits.SetByte(i, (flags & (1 << i)) ? header[offset++] : 0xFF);
+		if (flags & 0x20)
+			offset += mask_size;
+		for (int i = 0; i < further; ++i)
+		{
+			const bool present = (flags & 0x20) && ((header[mask + (i >> 3)] >> (i & 7)) & 1);
+			ack_bits.SetByte(4 + i, present ? header[offset++] : 0xFF);
+		}
+		return size;
+	}
+
+	// a payload received as [header front, data, tail] whose header ran extra bytes into data: moves the payload
+	// up to the front of data, bringing in what landed in tail (which must hold at least extra bytes)
+	//  + received is the number of bytes that landed in data and tail, returns the payload size, at most size
+
+	inline int shift_payload(unsigned char data[], int size, const unsigned char tail[], int received, int extra)
+	{
+		const int payload = received - extra;
+		const int bytes = payload < size ? payload : size;
+		if (bytes <= 0)
+			return 0;
+		if (extra == 0)
+			return bytes;
+		int moved = 0;
+		if (extra < size)
+		{
+			moved = size - extra < bytes ? size - extra : bytes;
+			std::memmove(data, data + extra, moved);
+		}
+		std::memcpy(data + moved, tail + (extra + moved - size), bytes - moved);
+		return bytes;
+	}
+
+	// connection with reliability (seq/ack)
+
+	class ReliableConnection : public Connection
+	{
+	public:
+
+		ReliableConnection(unsigned int protocolId, float timeout, unsigned int max_sequence = 0xFFFFFFFF)
+			: Connection(protocolId, timeout), reliabilitySystem(max_sequence)
+		{
+			ClearData();
+#ifdef NET_UNIT_TEST
+			packet_loss_mask = 0;
+#endif
+		}
+
+		~ReliableConnection()
+		{
+			if (IsRunning())
+				Stop();
+		}
+
+		// overriden functions from "Connection"
+
+		bool SendPacket(const unsigned char data[], int size)
+		{
+#ifdef NET_UNIT_TEST
+			if (reliabilitySystem.GetLocalSequence() & packet_loss_mask)
+			{
+				reliabilitySystem.PacketSent(size);
+				return true;
+			}
+#endif
+			unsigned char packet[HeaderBufferSize];
+			unsigned int seq = reliabilitySystem.GetLocalSequence();
+			unsigned int ack = reliabilitySystem.GetRemoteSequence();
+			const int header = WriteHeader(packet, seq, ack, reliabilitySystem.GetAckBits());
+			Segment segments[2] = { { packet, header }, { (void*)data, size } };
+			if (!SendSegments(segments, 2))
+				return false;
+			reliabilitySystem.PacketSent(size);
+			return true;
+		}
+
+		// zero copy send: the reliability header goes out from a connection owned slot, data by reference
+		//  + data must stay untouched until IsSendComplete(id), poll completions before recycling the buffer
+
+		bool SendPacketZeroCopy(const unsigned char data[], int size, unsigned int& id)
+		{
+#ifdef NET_UNIT_TEST
+			if (reliabilitySystem.GetLocalSequence() & packet_loss_mask)
+			{
+				reliabilitySystem.PacketSent(size);
+				id = 0;
+				return true;
+			}
+#endif
+			unsigned char packet[HeaderBufferSize];
+			unsigned int seq = reliabilitySystem.GetLocalSequence();
+			unsigned int ack = reliabilitySystem.GetRemoteSequence();
+			const int header = WriteHeader(packet, seq, ack, reliabilitySystem.GetAckBits());
+			if (!SendZeroCopy(packet, header, data, size, id))
+				return false;
+			reliabilitySystem.PacketSent(size);
+			return true;
+		}
+
+		int ReceivePacket(unsigned char data[], int size)
+		{
+			// the reliability header and the payload are received straight into place
+			//  + a compact header is only known to be at least CompactHeaderMinSize bytes, whatever more of it
+			//    there is runs into data and the payload is moved up over it
+			const int front = IsCompactHeader() ? CompactHeaderMinSize : reliability_header_size(GetAckBitsWidth());
+			const int largest = GetReliabilityHeaderSize();
+			unsigned char packet[HeaderBufferSize];
+			unsigned char tail[HeaderBufferSize - CompactHeaderMinSize];
+			Segment segments[3] = { { packet, front }, { data, size }, { tail, (int)sizeof(tail) } };
+			int received_bytes = ReceiveSegments(segments, IsCompactHeader() ? 3 : 2);
+			if (received_bytes <= front)
+				return false;
+			if (front < largest)
+				gather_prefix(packet + front, (received_bytes < largest ? received_bytes : largest) - front, segments + 1, 2);
+			unsigned int packet_sequence = 0;
+			unsigned int packet_ack = 0;
+			AckBits packet_ack_bits;
+			const int header = ReadHeader(packet, received_bytes, packet_sequence, packet_ack, packet_ack_bits);
+			if (header == 0 || received_bytes <= header)
+				return false;
+			reliabilitySystem.PacketReceived(packet_sequence, received_bytes - header);
+			reliabilitySystem.ProcessAck(packet_ack, packet_ack_bits, GetReceiveTime());
+			return shift_payload(data, size, tail, received_bytes - front, header - front);
+		}
+
+		// batched send: each packet gets its own sequence number, all share the current ack and ack bits
+
+		int SendPackets(const unsigned char* const data[], const int sizes[], int count)
+		{
+			assert(count <= MaxPacketBatch);
+#ifdef NET_UNIT_TEST
+			if (packet_loss_mask)
+			{
+				int sent = 0;
+				while (sent < count && SendPacket(data[sent], sizes[sent]))
+					sent++;
+				return sent;
+			}
+#endif
+			const int stride = (int)reliablePacketBuffer.size();
+			const unsigned char* packetData[MaxPacketBatch];
+			int packetSizes[MaxPacketBatch];
+			unsigned int seq = reliabilitySystem.GetLocalSequence();
+			unsigned int ack = reliabilitySystem.GetRemoteSequence();
+			const AckBits& ack_bits = reliabilitySystem.GetAckBits();
+			for (int i = 0; i < count; ++i)
+			{
+				unsigned char* packet = &reliableBatchBuffer[i * stride];
+				const int header = WriteHeader(packet, seq, ack, ack_bits);
+				if (sizes[i] + header > stride)
+				{
+					count = i;
+					break;
+				}
+				std::memcpy(packet + header, data[i], sizes[i]);
+				packetData[i] = packet;
+				packetSizes[i] = sizes[i] + header;
+				seq = seq == reliabilitySystem.GetMaxSequence() ? 0 : seq + 1;
+			}
+			int sent = Connection::SendPackets(packetData, packetSizes, count);
+			for (int i = 0; i < sent; ++i)
+				reliabilitySystem.PacketSent(sizes[i]);
+			return sent;
+		}
+
+		// batched receive: see Connection::ReceivePackets
+
+		int ReceivePackets(unsigned char* data[], int sizes[], int count, long long times[] = NULL)
+		{
+			assert(count <= MaxPacketBatch);
+			const int stride = (int)reliablePacketBuffer.size();
+			unsigned char* packetData[MaxPacketBatch];
+			int packetSizes[MaxPacketBatch];
+			long long packetTimes[MaxPacketBatch];
+			for (int i = 0; i < count; ++i)
+			{
+				if (sizes[i] <= 0)
+					return 0;
+				packetData[i] = &reliableBatchBuffer[i * stride];
+				packetSizes[i] = stride;
+			}
+			int received = Connection::ReceivePackets(packetData, packetSizes, count, packetTimes);
+			int valid = 0;
+			for (int i = 0; i < received; ++i)
+			{
+				unsigned int packet_sequence = 0;
+				unsigned int packet_ack = 0;
+				AckBits packet_ack_bits;
+				const int header = ReadHeader(packetData[i], packetSizes[i], packet_sequence, packet_ack, packet_ack_bits);
+				if (header == 0 || packetSizes[i] <= header)
+					continue;
+				reliabilitySystem.PacketReceived(packet_sequence, packetSizes[i] - header);
+				reliabilitySystem.ProcessAck(packet_ack, packet_ack_bits, packetTimes[i]);
+				if (packetSizes[i] - header > sizes[valid])
+					packetSizes[i] = sizes[valid] + header;
+				std::memcpy(data[valid], packetData[i] + header, packetSizes[i] - header);
+				if (times)
+					times[valid] = packetTimes[i];
+				sizes[valid++] = packetSizes[i] - header;
+			}
+			return valid;
+		}
+
+		void Update(float deltaTime)
+		{
+			Connection::Update(deltaTime);
+			reliabilitySystem.Update(deltaTime);
+		}
+
+		// the largest header, compact headers are often smaller
+
+		int GetHeaderSize() const
+		{
+			return Connection::GetHeaderSize() + GetReliabilityHeaderSize();
 		}
 
-		void Connect(const Address& address)
+		int GetMaxPayloadSize() const
 		{
-			printf("client connecting to %d.%d.%d.%d:%d\n",
-				address.GetA(), address.GetB(), address.GetC(), address.GetD(), address.GetPort());
-			bool connected = IsConnected();
-			ClearData();
-			if (connected)
-				OnDisconnect();
-			mode = Client;
-			state = Connecting;
-			this->address = address;
+			return GetPathMtu() - GetHeaderSize();
 		}
 
-		bool IsConnecting() const
+		ReliabilitySystem& GetReliabilitySystem()
 		{
-			return state == Connecting;
+			return reliabilitySystem;
 		}
 
-		bool ConnectFailed() const
+		// offer the compact reliability header (see write_compact_header) in the connect handshake, call before connecting or listening
+		//  + needs the handshake enabled and a max sequence the encoding takes, returns false otherwise
+
+		bool EnableCompactHeader()
 		{
-			return state == ConnectFail;
+			if (!IsHandshakeEnabled() || !compact_header_supported(reliabilitySystem.GetMaxSequence()))
+				return false;
+			OfferOptions(CompactHeaderOption);
+			return true;
 		}
 
-		bool IsConnected() const
+		// the handshake agreed on compact headers for the current connection
+
+		bool IsCompactHeader() const
 		{
-			return state == Connected;
+			return (GetOptions() & CompactHeaderOption) != 0;
 		}
 
-		bool IsListening() const
+		// offer ack bits up to bits wide (64, 128 or 256, see AckBits) in the connect handshake, call before connecting or listening
+		//  + wider ack bits reach further back, so more packets in flight get acked through a run of lost acks
+		//  + needs the handshake enabled, returns false otherwise
+
+		bool EnableWideAcks(int bits)
 		{
-			return state == Listening;
+			if (!IsHandshakeEnabled() || bits < 64 || bits > MaxAckBits)
+				return false;
+			OfferOptions(ack_bits_options(bits));
+			return true;
 		}
 
-		Mode GetMode() const
+		// the ack bits width the handshake agreed on for the current connection, 32 unless wide acks were agreed
+
+		int GetAckBitsWidth() const
 		{
-			return mode;
+			return ack_bits_width(GetOptions());
 		}
 
-		virtual void Update(float deltaTime)
+		// unit test controls
+
+#ifdef NET_UNIT_TEST
+		void SetPacketLossMask(unsigned int mask)
 		{
-			assert(running);
-			timeoutAccumulator += deltaTime;
-			if (timeoutAccumulator > timeout)
-			{
-				if (state == Connecting)
-				{
-					printf("connect timed out\n");
-					ClearData();
-					state = ConnectFail;
-					OnDisconnect();
-				}
-				else if (state == Connected)
-				{
-					printf("connection timed out\n");
-					ClearData();
-					if (state == Connecting)
-						state = ConnectFail;
-					OnDisconnect();
-				}
-			}
+			packet_loss_mask = mask;
 		}
+#endif
 
-		virtual bool SendPacket(const unsigned char data[], int size)
+	protected:
+
+		enum
 		{
-			assert(running);
-			if (address.GetAddress() == 0)
-				return false;
-			unsigned char packet[PacketSizeHack];
-			packet[0] = (unsigned char)(protocolId >> 24);
-			packet[1] = (unsigned char)((protocolId >> 16) & 0xFF);
-			packet[2] = (unsigned char)((protocolId >> 8) & 0xFF);
-			packet[3] = (unsigned char)((protocolId) & 0xFF);
-			std::memcpy(&packet[4], data, size);
-			return socket.Send(address, packet, size + 4);
+			HeaderBufferSize = CompactHeaderMaxSize > ReliabilityHeaderMaxSize ? CompactHeaderMaxSize : ReliabilityHeaderMaxSize
+		};
+
+		// the largest reliability header in the format and ack bits width agreed for the connection
+
+		int GetReliabilityHeaderSize() const
+		{
+			return IsCompactHeader() ? compact_header_max_size(GetAckBitsWidth()) : reliability_header_size(GetAckBitsWidth());
 		}
 
-		virtual int ReceivePacket(unsigned char data[], int size)
+		// in the format agreed for the connection, returns the header size
+
+		int WriteHeader(unsigned char* header, unsigned int sequence, unsigned int ack, const AckBits& ack_bits)
 		{
-			assert(running);
-			unsigned char packet[PacketSizeHack];
-			Address sender;
-			int bytes_read = socket.Receive(sender, packet, size + 4);
-			if (bytes_read == 0)
-				return 0;
-			if (bytes_read <= 4)
-				return 0;
-			if (packet[0] != (unsigned char)(protocolId >> 24) ||
-				packet[1] != (unsigned char)((protocolId >> 16) & 0xFF) ||
-				packet[2] != (unsigned char)((protocolId >> 8) & 0xFF) ||
-				packet[3] != (unsigned char)(protocolId & 0xFF))
+			if (IsCompactHeader())
+				return write_compact_header(header, sequence, ack, ack_bits, GetAckBitsWidth(), reliabilitySystem.GetMaxSequence());
+			write_reliability_header(header, sequence, ack, ack_bits, GetAckBitsWidth());
+			return reliability_header_size(GetAckBitsWidth());
+		}
+
+		// from the first bytes of a packet, returns the header size or zero if the packet has no valid header
+
+		int ReadHeader(const unsigned char* header, int bytes, unsigned int& sequence, unsigned int& ack, AckBits& ack_bits)
+		{
+			const int width = GetAckBitsWidth();
+			if (IsCompactHeader())
+				return read_compact_header(header, bytes, sequence, ack, ack_bits, width, reliabilitySystem.GetRemoteSequence(),
+					reliabilitySystem.GetLocalSequence(), reliabilitySystem.GetMaxSequence());
+			if (bytes < reliability_header_size(width))
 				return 0;
-			if (mode == Server && !IsConnected())
-			{
-				printf("server accepts connection from client %d.%d.%d.%d:%d\n",
-					sender.GetA(), sender.GetB(), sender.GetC(), sender.GetD(), sender.GetPort());
-				state = Connected;
-				address = sender;
-				OnConnect();
-			}
-			if (sender == address)
-			{
-				if (mode == Client && state == Connecting)
-				{
-					printf("client completes connection with server\n");
-					state = Connected;
-					OnConnect();
-				}
-				timeoutAccumulator = 0.0f;
-				memcpy(data, &packet[4], bytes_read - 4);
-				return bytes_read - 4;
-			}
-			return 0;
+			read_reliability_header(header, sequence, ack, ack_bits, width);
+			return reliability_header_size(width);
 		}
 
-		int GetHeaderSize() const
+		virtual void OnStart()
 		{
-			return 4;
+			// reliability header + payload of the largest datagram the connection carries
+			reliablePacketBuffer.resize(GetMaxPacketSize() - Connection::GetHeaderSize());
+			reliableBatchBuffer.resize(MaxPacketBatch * reliablePacketBuffer.size());
 		}
 
-	protected:
+		virtual void OnStop()
+		{
+			ClearData();
+		}
 
-		virtual void OnStart() {}
-		virtual void OnStop() {}
-		virtual void OnConnect() {}
-		virtual void OnDisconnect() {}
+		virtual void OnDisconnect()
+		{
+			ClearData();
+		}
 
 	private:
 
 		void ClearData()
 		{
-			state = Disconnected;
-			timeoutAccumulator = 0.0f;
-			address = Address();
+			reliabilitySystem.Reset();
 		}
 
-		enum State
-		{
-			Disconnected,
-			Listening,
-			Connecting,
-			ConnectFail,
-			Connected
-		};
-
-		unsigned int protocolId;
-		float timeout;
+#ifdef NET_UNIT_TEST
+		unsigned int packet_loss_mask;			// mask sequence number, if non-zero, drop packet - for unit test only
+#endif
 
-		bool running;
-		Mode mode;
-		State state;
-		Socket socket;
-		float timeoutAccumulator;
-		Address address;
+		ReliabilitySystem reliabilitySystem;	// reliability system: manages sequence numbers and acks, tracks network stats etc.
+		std::vector<unsigned char> reliablePacketBuffer;	// one reliability packet (header + payload)
+		std::vector<unsigned char> reliableBatchBuffer;		// MaxPacketBatch reliability packets, reliablePacketBuffer.size() apart
 	};
 
-	// packet queue to store information about sent and received packets sorted in sequence order
-	//  + we define ordering using the "sequence_more_recent" function, this works provided there is a large gap when sequence wrap occurs
+	// timer scheduled on a TimingWheel, embed one per deadline in the object it belongs to
+	//  + must be cancelled (or have expired and been popped) before it is destroyed
 
-	struct PacketData
+	struct Timer
 	{
-		unsigned int sequence;			// packet sequence number
-		float time;					    // time offset since packet was sent or received (depending on context)
-		int size;						// packet size in bytes
+		Timer()
+		{
+			next = NULL;
+			pprev = NULL;
+			expires = 0;
+			data = NULL;
+		}
+
+		bool IsScheduled() const
+		{
+			return pprev != NULL;
+		}
+
+		Timer* next;					// next timer in the same slot
+		Timer** pprev;					// link pointing at this timer, NULL when not scheduled
+		unsigned long long expires;		// wheel tick this timer fires on
+		void* data;						// owner of the timer, for the code popping it
 	};
 
-	inline bool sequence_more_recent(unsigned int s1, unsigned int s2, unsigned int max_sequence)
-	{
-		auto half_max = max_sequence / 2;
-		return (
-			((s1 > s2) && (s1 - s2 <= half_max))
-			||
-			((s2 > s1) && (s2 - s1 > half_max))
-			);
-	}
+	// hierarchical timing wheel: schedule, cancel and expire timers in constant time however many are pending
+	//  + four levels of 64 slots, each level's slot spans a whole turn of the level below
+	//  + timers on the upper levels cascade down one level whenever the level below wraps around
+	//  + delays past the top level (2^24 ticks) are clamped, so very long timers fire early and should re-check
+	//  + Advance moves due timers to an expired list, PopExpired hands them out one at a time
 
-	class PacketQueue : public std::list<PacketData>
+	class TimingWheel
 	{
 	public:
 
-		bool exists(unsigned int sequence)
+		TimingWheel(float resolution = 0.001f)
 		{
-			for (iterator itor = begin(); itor != end(); ++itor)
-				if (itor->sequence == sequence)
-					return true;
-			return false;
+			assert(resolution > 0.0f);
+			this->resolution = resolution;
+			time = 0.0;
+			tick = 0;
+			expired = NULL;
+			for (int level = 0; level < Levels; ++level)
+				for (int slot = 0; slot < Slots; ++slot)
+					slots[level][slot] = NULL;
 		}
 
-		void insert_sorted(const PacketData& p, unsigned int max_sequence)
+		~TimingWheel()
 		{
-			if (empty())
-			{
-				push_back(p);
-			}
-			else
+			Clear();
+		}
+
+		// cancel every pending and expired timer
+
+		void Clear()
+		{
+			for (int level = 0; level < Levels; ++level)
+				for (int slot = 0; slot < Slots; ++slot)
+					while (slots[level][slot])
+						Unlink(*slots[level][slot]);
+			while (expired)
+				Unlink(*expired);
+		}
+
+		// (re)schedule a timer to fire delay seconds from now, rounded up to whole ticks and at least one
+
+		void Schedule(Timer& timer, float delay)
+		{
+			if (timer.IsScheduled())
+				Unlink(timer);
+			unsigned long long ticks = delay > 0.0f ? (unsigned long long)(delay / resolution) : 0;
+			if (ticks * resolution < delay)
+				ticks++;
+			if (ticks < 1)
+				ticks = 1;
+			timer.expires = tick + ticks;
+			Insert(timer);
+		}
+
+		void Cancel(Timer& timer)
+		{
+			if (timer.IsScheduled())
+				Unlink(timer);
+		}
+
+		// advance time, due timers move to the expired list
+
+		void Advance(float deltaTime)
+		{
+			time += deltaTime;
+			const unsigned long long target = (unsigned long long)(time / resolution);
+			while (tick < target)
 			{
-				if (!sequence_more_recent(p.sequence, front().sequence, max_sequence))
-				{
-					push_front(p);
-				}
-				else if (sequence_more_recent(p.sequence, back().sequence, max_sequence))
+				tick++;
+				if ((tick & SlotMask) == 0)
+					Cascade();
+				Timer** slot = &slots[0][tick & SlotMask];
+				while (*slot)
 				{
-					push_back(p);
+					Timer* timer = *slot;
+					Unlink(*timer);
+					Link(&expired, *timer);
 				}
-				else
+			}
+		}
+
+		// next expired timer, removed from the wheel, or NULL when none are left
+
+		Timer* PopExpired()
+		{
+			Timer* timer = expired;
+			if (timer)
+				Unlink(*timer);
+			return timer;
+		}
+
+		// seconds advanced since the wheel was created
+
+		double GetTime() const
+		{
+			return time;
+		}
+
+		float GetResolution() const
+		{
+			return resolution;
+		}
+
+		// seconds until Advance next has a timer due, or limit if none is due sooner
+		//  + scans the level 0 slots up to limit, a wrap with upper level timers to cascade counts as due,
+		//    so the answer may be early but is never late
+
+		float GetNextExpiry(float limit) const
+		{
+			if (expired)
+				return 0.0f;
+			unsigned long long last = (unsigned long long)((time + limit) / resolution);
+			if (last > tick + Slots)
+				last = tick + Slots;
+			for (unsigned long long t = tick + 1; t <= last; ++t)
+			{
+				bool due = slots[0][t & SlotMask] != NULL;
+				for (int level = 1; !due && level < Levels && (t & ((1ULL << (level * SlotBits)) - 1)) == 0; ++level)
+					due = slots[level][(t >> (level * SlotBits)) & SlotMask] != NULL;
+				if (due)
 				{
-					for (PacketQueue::iterator itor = begin(); itor != end(); itor++)
-					{
-						assert(itor->sequence != p.sequence);
-						if (sequence_more_recent(itor->sequence, p.sequence, max_sequence))
-						{
-							insert(itor, p);
-							break;
-						}
-					}
+					const double delay = t * (double)resolution - time;
+					return delay > 0.0 ? (float)delay : 0.0f;
 				}
 			}
+			const double delay = (last + 1) * (double)resolution - time;
+			return delay < limit ? (float)delay : limit;
+		}
+
+	private:
+
+		enum
+		{
+			Levels = 4,
+			SlotBits = 6,
+			Slots = 1 << SlotBits,
+			SlotMask = Slots - 1
+		};
+
+		static const unsigned long long MaxDelay = (1ULL << (Levels * SlotBits)) - 1;
+
+		void Link(Timer** list, Timer& timer)
+		{
+			timer.next = *list;
+			if (timer.next)
+				timer.next->pprev = &timer.next;
+			timer.pprev = list;
+			*list = &timer;
+		}
+
+		void Unlink(Timer& timer)
+		{
+			*timer.pprev = timer.next;
+			if (timer.next)
+				timer.next->pprev = timer.pprev;
+			timer.next = NULL;
+			timer.pprev = NULL;
+		}
+
+		// the lowest level whose turn covers the delay, in the slot of the expiry tick at that level
+
+		void Insert(Timer& timer)
+		{
+			if (timer.expires - tick > MaxDelay)
+				timer.expires = tick + MaxDelay;
+			const unsigned long long delay = timer.expires - tick;
+			int level = 0;
+			while (level < Levels - 1 && delay >> ((level + 1) * SlotBits))
+				level++;
+			Link(&slots[level][(timer.expires >> (level * SlotBits)) & SlotMask], timer);
 		}
 
-		void verify_sorted(unsigned int max_sequence)
+		// level 0 wrapped: bring the slot now due on each upper level down, stopping at the first level that did not wrap
+
+		void Cascade()
 		{
-			PacketQueue::iterator prev = end();
-			for (PacketQueue::iterator itor = begin(); itor != end(); itor++)
+			for (int level = 1; level < Levels; ++level)
 			{
-				assert(itor->sequence <= max_sequence);
-				if (prev != end())
+				const int index = (int)((tick >> (level * SlotBits)) & SlotMask);
+				Timer* list = slots[level][index];
+				if (list)
+					list->pprev = &list;
+				slots[level][index] = NULL;
+				while (list)
 				{
-					assert(sequence_more_recent(itor->sequence, prev->sequence, max_sequence));
-					prev = itor;
+					Timer* timer = list;
+					Unlink(*timer);
+					Insert(*timer);
 				}
+				if (index != 0)
+					break;
 			}
 		}
+
+		float resolution;					// seconds per tick
+		double time;						// seconds advanced so far
+		unsigned long long tick;			// ticks processed so far
+		Timer* slots[Levels][Slots];		// pending timers per level and slot
+		Timer* expired;						// timers that fired and were not popped yet
 	};
 
-	// reliability system to support reliable connection
-	//  + manages sent, received, pending ack and acked packet queues
-	//  + separated out from reliable connection because it is quite complex and i want to unit test it!
+	// one client of a ConnectionManager: the peer address plus its own reliability state
 
-	class ReliabilitySystem
+	class Session
 	{
 	public:
 
-		ReliabilitySystem(unsigned int max_sequence = 0xFFFFFFFF)
+		Session(const Address& address, unsigned int max_sequence)
+			: address(address), reliabilitySystem(max_sequence)
 		{
-			this->rtt_maximum = rtt_maximum;
-			this->max_sequence = max_sequence;
-			Reset();
+			lastReceiveTime = 0.0;
+			lastUpdateTime = 0.0;
+			timeoutTimer.data = this;
+			expiryTimer.data = this;
+			userData = NULL;
+			options = 0;
 		}
 
-		void Reset()
+		const Address& GetAddress() const
 		{
-			local_sequence = 0;
-			remote_sequence = 0;
-			sentQueue.clear();
-			receivedQueue.clear();
-			pendingAckQueue.clear();
-			ackedQueue.clear();
-			sent_packets = 0;
-			recv_packets = 0;
-			lost_packets = 0;
-			acked_packets = 0;
-			sent_bandwidth = 0.0f;
-			acked_bandwidth = 0.0f;
-			rtt = 0.0f;
-			rtt_maximum = 1.0f;
+			return address;
 		}
 
-		void PacketSent(int size)
+		// options agreed with the client in the handshake, see Connection::GetOptions
+
+		unsigned int GetOptions() const
 		{
-			if (sentQueue.exists(local_sequence))
-			{
-				printf("local sequence %d exists\n", local_sequence);
-				for (PacketQueue::iterator itor = sentQueue.begin(); itor != sentQueue.end(); ++itor)
-					printf(" + %d\n", itor->sequence);
-			}
-			assert(!sentQueue.exists(local_sequence));
-			assert(!pendingAckQueue.exists(local_sequence));
-			PacketData data;
-			data.sequence = local_sequence;
-			data.time = 0.0f;
-			data.size = size;
-			sentQueue.push_back(data);
-			pendingAckQueue.push_back(data);
-			sent_packets++;
-			local_sequence++;
-			if (local_sequence > max_sequence)
-				local_sequence = 0;
+			return options;
 		}
 
-		void PacketReceived(unsigned int sequence, int size)
+		ReliabilitySystem& GetReliabilitySystem()
 		{
-			recv_packets++;
-			if (receivedQueue.exists(sequence))
-				return;
-			PacketData data;
-			data.sequence = sequence;
-			data.time = 0.0f;
-			data.size = size;
-			receivedQueue.push_back(data);
-			if (sequence_more_recent(sequence, remote_sequence, max_sequence))
-				remote_sequence = sequence;
+			return reliabilitySystem;
 		}
 
-		unsigned int GenerateAckBits()
+		// application state attached to the session, owned by the application (see ConnectionManager::OnSessionEnd)
+
+		void SetUserData(void* userData)
 		{
-			return generate_ack_bits(GetRemoteSequence(), receivedQueue, max_sequence);
+			this->userData = userData;
 		}
 
-		void ProcessAck(unsigned int ack, unsigned int ack_bits)
+		void* GetUserData() const
 		{
-			process_ack(ack, ack_bits, pendingAckQueue, ackedQueue, acks, acked_packets, rtt, max_sequence);
+			return userData;
 		}
 
-		void Update(float deltaTime)
+	private:
+
+		friend class ConnectionManager;
+
+		Address address;
+		ReliabilitySystem reliabilitySystem;
+		double lastReceiveTime;				// manager time the last packet arrived
+		double lastUpdateTime;				// manager time the reliability system was last updated to
+		Timer timeoutTimer;					// fires when the session may have timed out
+		Timer expiryTimer;					// fires when the reliability system next drops a queued packet
+		void* userData;
+		unsigned int options;				// see ConnectOption
+	};
+
+	// server side of many reliable connections on one socket
+	//  + datagrams are demultiplexed by sender address into sessions, each with its own reliability system
+	//  + speaks the ReliableConnection wire format, so ReliableConnection clients connect to it unchanged
+	//  + a session starts with the first valid packet from a new address and ends after timeout seconds of silence,
+	//    or with the handshake enabled only once the address has echoed a connect cookie
+
+	class ConnectionManager
+	{
+	public:
+
+		ConnectionManager(unsigned int protocolId, float timeout, int maxSessions = 256, unsigned int max_sequence = 0xFFFFFFFF)
 		{
-			acks.clear();
-			AdvanceQueueTime(deltaTime);
-			UpdateQueues();
-			UpdateStats();
-#ifdef NET_UNIT_TEST
-			Validate();
-#endif
+			this->protocolId = protocolId;
+			this->timeout = timeout;
+			this->maxSessions = maxSessions;
+			this->max_sequence = max_sequence;
+			running = false;
+			transport = &socket;
+			maxPacketSize = DefaultMaxPacketSize;
+			handshake = false;
+			offeredOptions = 0;
+			bandwidthWindow = 1.0f;
+			sessions.Reserve(maxSessions);
 		}
 
-		void Validate()
+		virtual ~ConnectionManager()
 		{
-			sentQueue.verify_sorted(max_sequence);
-			receivedQueue.verify_sorted(max_sequence);
-			pendingAckQueue.verify_sorted(max_sequence);
-			ackedQueue.verify_sorted(max_sequence);
+			if (IsRunning())
+				Stop();
 		}
 
-		// utility functions
+		// see Connection::SetTransport
 
-	/*
-		static bool sequence_more_recent( unsigned int s1, unsigned int s2, unsigned int max_sequence )
+		void SetTransport(Transport* transport)
 		{
-			return ( s1 > s2 ) && ( s1 - s2 <= max_sequence/2 ) || ( s2 > s1 ) && ( s2 - s1 > max_sequence/2 );
+			assert(!running);
+			this->transport = transport ? transport : &socket;
 		}
-	*/
 
-		static int bit_index_for_sequence(unsigned int sequence, unsigned int ack, unsigned int max_sequence)
+		// see Connection::EnableHandshake, packets from addresses without a session are then dropped unprocessed
+
+		void EnableHandshake()
 		{
-			assert(sequence != ack);
-			assert(!sequence_more_recent(sequence, ack, max_sequence));
-			if (sequence > ack)
-			{
-				assert(ack < 33);
-				assert(max_sequence >= sequence);
-				return ack + (max_sequence - sequence);
-			}
-			else
-			{
-				assert(ack >= 1);
-				assert(sequence <= ack - 1);
-				return ack - 1 - sequence;
-			}
+			handshake = true;
 		}
 
-		static unsigned int generate_ack_bits(unsigned int ack, const PacketQueue& received_queue, unsigned int max_sequence)
+		bool IsHandshakeEnabled() const
 		{
-			unsigned int ack_bits = 0;
-			for (PacketQueue::const_iterator itor = received_queue.begin(); itor != received_queue.end(); itor++)
-			{
-				if (itor->sequence == ack || sequence_more_recent(itor->sequence, ack, max_sequence))
-					break;
-				int bit_index = bit_index_for_sequence(itor->sequence, ack, max_sequence);
-				if (bit_index <= 31)
-					ack_bits |= 1 << bit_index;
-			}
-			return ack_bits;
+			return handshake;
 		}
 
-		static void process_ack(unsigned int ack, unsigned int ack_bits,
-			PacketQueue& pending_ack_queue, PacketQueue& acked_queue,
-			std::vector<unsigned int>& acks, unsigned int& acked_packets,
-			float& rtt, unsigned int max_sequence)
+		// see ReliableConnection::EnableCompactHeader, each session gets the header format agreed with its client
+
+		bool EnableCompactHeader()
 		{
-			if (pending_ack_queue.empty())
-				return;
+			if (!handshake || !compact_header_supported(max_sequence))
+				return false;
+			offeredOptions |= CompactHeaderOption;
+			return true;
+		}
 
-			PacketQueue::iterator itor = pending_ack_queue.begin();
-			while (itor != pending_ack_queue.end())
-			{
-				bool acked = false;
+		// see ReliableConnection::EnableWideAcks, each session gets the ack bits width agreed with its client
 
-				if (itor->sequence == ack)
-				{
-					acked = true;
-				}
-				else if (!sequence_more_recent(itor->sequence, ack, max_sequence))
-				{
-					int bit_index = bit_index_for_sequence(itor->sequence, ack, max_sequence);
-					if (bit_index <= 31)
-						acked = (ack_bits >> bit_index) & 1;
-				}
+		bool EnableWideAcks(int bits)
+		{
+			if (!handshake || bits < 64 || bits > MaxAckBits)
+				return false;
+			offeredOptions |= ack_bits_options(bits);
+			return true;
+		}
 
-				if (acked)
-				{
-					rtt += (itor->time - rtt) * 0.1f;
+		// see ReliabilitySystem::SetBandwidthWindow, applies to sessions started from now on
 
-					acked_queue.insert_sorted(*itor, max_sequence);
-					acks.push_back(itor->sequence);
-					acked_packets++;
-					itor = pending_ack_queue.erase(itor);
-				}
-				else
-					++itor;
-			}
+		void SetBandwidthWindow(float seconds)
+		{
+			bandwidthWindow = seconds;
 		}
 
-		// data accessors
+		// see Connection::SetMaxPacketSize
 
-		unsigned int GetLocalSequence() const
+		void SetMaxPacketSize(int size)
 		{
-			return local_sequence;
+			assert(!running);
+			assert(size > 4 + HeaderBufferSize && size <= MaxOffloadSize);
+			maxPacketSize = size;
 		}
 
-		unsigned int GetRemoteSequence() const
+		int GetMaxPacketSize() const
 		{
-			return remote_sequence;
+			return maxPacketSize;
 		}
 
-		unsigned int GetMaxSequence() const
+		bool Start(int port, bool shared = false)
 		{
-			return max_sequence;
+			assert(!running);
+			printf("start connection manager on port %d\n", port);
+			if (!transport->Open(port, shared))
+				return false;
+			packetBuffer.resize(maxPacketSize);
+			batchBuffer.resize(MaxPacketBatch * maxPacketSize);
+			running = true;
+			return true;
 		}
 
-		void GetAcks(unsigned int** acks, int& count)
+		void Stop()
 		{
-			*acks = &this->acks[0];
-			count = (int)this->acks.size();
+			assert(running);
+			printf("stop connection manager\n");
+			expired.clear();
+			for (int i = 0; i < sessions.GetCapacity(); ++i)
+			{
+				if (sessions.IsUsed(i))
+					expired.push_back(sessions.GetValue(i));
+			}
+			for (size_t i = 0; i < expired.size(); ++i)
+				EndSession(expired[i]);
+			transport->Close();
+			running = false;
 		}
 
-		unsigned int GetSentPackets() const
+		bool IsRunning() const
 		{
-			return sent_packets;
+			return running;
 		}
 
-		unsigned int GetReceivedPackets() const
+		int GetHandle() const
 		{
-			return recv_packets;
+			return transport->GetHandle();
 		}
 
-		unsigned int GetLostPackets() const
+		bool SetBufferSizes(int receiveSize, int sendSize)
 		{
-			return lost_packets;
+			assert(running);
+			if (transport != &socket)
+				return false;
+			return socket.SetBufferSizes(receiveSize, sendSize);
 		}
 
-		unsigned int GetAckedPackets() const
+		bool EnableTimestamps()
 		{
-			return acked_packets;
+			assert(running);
+			if (transport != &socket)
+				return false;
+			return socket.EnableTimestamps();
 		}
 
-		float GetSentBandwidth() const
+		bool EnableDropAccounting()
 		{
-			return sent_bandwidth;
+			assert(running);
+			if (transport != &socket)
+				return false;
+			return socket.EnableDropAccounting();
 		}
 
-		float GetAckedBandwidth() const
+		unsigned int GetDroppedPackets() const
 		{
-			return acked_bandwidth;
+			return socket.GetDroppedPackets();
 		}
 
-		float GetRoundTripTime() const
+		bool EnableBusyPoll(int microseconds)
 		{
-			return rtt;
+			assert(running);
+			if (transport != &socket)
+				return false;
+			return socket.EnableBusyPoll(microseconds);
 		}
 
-		int GetHeaderSize() const
+		int GetSessionCount() const
 		{
-			return 12;
+			return sessions.GetCount();
 		}
 
-	protected:
-
-		void AdvanceQueueTime(float deltaTime)
+		Session* FindSession(const Address& address)
 		{
-			for (PacketQueue::iterator itor = sentQueue.begin(); itor != sentQueue.end(); itor++)
-				itor->time += deltaTime;
+			Session** session = sessions.Find(address);
+			return session ? *session : NULL;
+		}
+
+		// advance time and handle the session timers that fired
+		//  + sessions are only touched when they time out or their reliability queues expire, never just for being idle
 
-			for (PacketQueue::iterator itor = receivedQueue.begin(); itor != receivedQueue.end(); itor++)
-				itor->time += deltaTime;
+		void Update(float deltaTime)
+		{
+			assert(running);
+			expired.clear();
+			wheel.Advance(deltaTime);
+			while (Timer* timer = wheel.PopExpired())
+			{
+				Session* session = (Session*)timer->data;
+				if (timer == &session->timeoutTimer)
+				{
+					// lazily rescheduled, receiving a packet only records the time
+					const float idle = (float)(wheel.GetTime() - session->lastReceiveTime);
+					if (idle >= timeout)
+					{
+						printf("session %d.%d.%d.%d:%d timed out\n",
+							session->address.GetA(), session->address.GetB(), session->address.GetC(), session->address.GetD(), session->address.GetPort());
+						expired.push_back(session);
+					}
+					else
+						wheel.Schedule(session->timeoutTimer, timeout - idle);
+				}
+				else
+				{
+					UpdateReliability(*session);
+					ScheduleExpiry(*session);
+				}
+			}
+			for (size_t i = 0; i < expired.size(); ++i)
+				EndSession(expired[i]);
+		}
 
-			for (PacketQueue::iterator itor = pendingAckQueue.begin(); itor != pendingAckQueue.end(); itor++)
-				itor->time += deltaTime;
+		// seconds until Update next has a session timer to handle, at most limit, for Reactor::SetDeadline
 
-			for (PacketQueue::iterator itor = ackedQueue.begin(); itor != ackedQueue.end(); itor++)
-				itor->time += deltaTime;
+		float GetNextExpiry(float limit) const
+		{
+			return wheel.GetNextExpiry(limit);
 		}
 
-		void UpdateQueues()
+		bool SendPacket(Session& session, const unsigned char data[], int size)
 		{
-			const float epsilon = 0.001f;
+			assert(running);
+			const int width = ack_bits_width(session.options);
+			const int largest = (session.options & CompactHeaderOption) ? compact_header_max_size(width) : reliability_header_size(width);
+			if (size + 4 + largest > maxPacketSize)
+				return false;
+			UpdateReliability(session);
+			ReliabilitySystem& reliability = session.reliabilitySystem;
+			unsigned char header[4 + HeaderBufferSize];
+			header[0] = (unsigned char)(protocolId >> 24);
+			header[1] = (unsigned char)((protocolId >> 16) & 0xFF);
+			header[2] = (unsigned char)((protocolId >> 8) & 0xFF);
+			header[3] = (unsigned char)((protocolId) & 0xFF);
+			int headerSize = 4 + reliability_header_size(width);
+			if (session.options & CompactHeaderOption)
+				headerSize = 4 + write_compact_header(header + 4, reliability.GetLocalSequence(), reliability.GetRemoteSequence(),
+					reliability.GetAckBits(), width, max_sequence);
+			else
+				write_reliability_header(header + 4, reliability.GetLocalSequence(), reliability.GetRemoteSequence(), reliability.GetAckBits(), width);
+			Segment segments[2] = { { header, headerSize }, { (void*)data, size } };
+			if (!transport->SendSegments(session.address, segments, 2))
+				return false;
+			reliability.PacketSent(size);
+			ScheduleExpiry(session);
+			return true;
+		}
 
-			while (sentQueue.size() && sentQueue.front().time > rtt_maximum + epsilon)
-				sentQueue.pop_front();
+		// receive the next packet from any client, session is set to the sender's session
+		//  + returns the payload size, zero when nothing is pending
 
-			if (receivedQueue.size())
+		int ReceivePacket(Session*& session, unsigned char data[], int size)
+		{
+			assert(running);
+			// headers and payload are received straight into place, see Connection::ReceiveSegments
+			//  + with compact headers on offer only the smallest header is certain, the rest of it (or of a full
+			//    header or a control packet) runs into data and the payload is moved up over it, see shift_payload
+			const int front = 4 + ((offeredOptions & CompactHeaderOption) ? CompactHeaderMinSize : ReliabilityHeaderSize);
+			while (true)
 			{
-				const unsigned int latest_sequence = receivedQueue.back().sequence;
-				const unsigned int minimum_sequence = latest_sequence >= 34 ? (latest_sequence - 34) : max_sequence - (34 - latest_sequence);
-				while (receivedQueue.size() && !sequence_more_recent(receivedQueue.front().sequence, minimum_sequence, max_sequence))
-					receivedQueue.pop_front();
+				Address sender;
+				unsigned char header[4 + HeaderBufferSize];
+				unsigned char tail[HeaderBufferSize - CompactHeaderMinSize];
+				Segment segments[4] = { { header, front }, { data, size }, { tail, (int)sizeof(tail) }, { &packetBuffer[0], maxPacketSize } };
+				int bytes_read = transport->ReceiveSegments(sender, segments, 4);
+				if (bytes_read <= 0)
+					return 0;
+				if (bytes_read > front)
+					gather_prefix(header + front, (bytes_read < (int)sizeof(header) ? bytes_read : (int)sizeof(header)) - front, segments + 1, 3);
+				int headerSize = 0;
+				int result = ProcessHeader(sender, header, bytes_read, transport->GetReceiveTime(), session, headerSize);
+				if (result > 0)
+					return shift_payload(data, size, tail, bytes_read - front, headerSize - front);
 			}
+		}
 
-			while (ackedQueue.size() && ackedQueue.front().time > rtt_maximum * 2 - epsilon)
-				ackedQueue.pop_front();
+		// receive the next payload from any client straight into a buffer from pool, see Connection::ReceivePooledPacket
 
-			while (pendingAckQueue.size() && pendingAckQueue.front().time > rtt_maximum + epsilon)
+		int ReceivePooledPacket(PacketPool& pool, Session*& session, PooledPacket& packet)
+		{
+			packet.data = NULL;
+			packet.size = 0;
+			packet.index = pool.Acquire();
+			if (packet.index < 0)
+				return 0;
+			unsigned char* buffer = pool.GetBuffer(packet.index);
+			const int size = ReceivePacket(session, buffer, pool.GetBufferSize());
+			if (size <= 0)
 			{
-				pendingAckQueue.pop_front();
-				lost_packets++;
+				pool.Release(packet);
+				return 0;
 			}
+			packet.data = buffer;
+			packet.size = size;
+			return size;
 		}
 
-		void UpdateStats()
+		// batched receive: sessions[i] is set to the session of the packet in data[i], otherwise as Connection::ReceivePackets
+
+		int ReceivePackets(Session* sessions[], unsigned char* data[], int sizes[], int count, long long times[] = NULL)
 		{
-			int sent_bytes_per_second = 0;
-			for (PacketQueue::iterator itor = sentQueue.begin(); itor != sentQueue.end(); ++itor)
-				sent_bytes_per_second += itor->size;
-			int acked_packets_per_second = 0;
-			int acked_bytes_per_second = 0;
-			for (PacketQueue::iterator itor = ackedQueue.begin(); itor != ackedQueue.end(); ++itor)
+			assert(running);
+			assert(count <= MaxPacketBatch);
+			Datagram datagrams[MaxPacketBatch];
+			for (int i = 0; i < count; ++i)
+			{
+				datagrams[i].data = &batchBuffer[i * maxPacketSize];
+				datagrams[i].size = maxPacketSize;
+			}
+			int received = transport->ReceiveBatch(datagrams, count);
+			int valid = 0;
+			for (int i = 0; i < received; ++i)
 			{
-				if (itor->time >= rtt_maximum)
+				int bytes_read = ProcessPacket(datagrams[i].address, (const unsigned char*)datagrams[i].data, datagrams[i].size,
+					datagrams[i].timestamp, sessions[valid], data[valid], sizes[valid]);
+				if (bytes_read > 0)
 				{
-					acked_packets_per_second++;
-					acked_bytes_per_second += itor->size;
+					if (times)
+						times[valid] = datagrams[i].timestamp;
+					sizes[valid++] = bytes_read;
 				}
 			}
-			sent_bytes_per_second /= rtt_maximum;
-			acked_bytes_per_second /= rtt_maximum;
-			sent_bandwidth = sent_bytes_per_second * (8 / 1000.0f);
-			acked_bandwidth = acked_bytes_per_second * (8 / 1000.0f);
+			return valid;
 		}
 
-	private:
-
-		unsigned int max_sequence;			// maximum sequence value before wrap around (used to test sequence wrap at low # values)
-		unsigned int local_sequence;		// local sequence number for most recently sent packet
-		unsigned int remote_sequence;		// remote sequence number for most recently received packet
-
-		unsigned int sent_packets;			// total number of packets sent
-		unsigned int recv_packets;			// total number of packets received
-		unsigned int lost_packets;			// total number of packets lost
-		unsigned int acked_packets;			// total number of packets acked
+		// the largest header of any session
 
-		float sent_bandwidth;				// approximate sent bandwidth over the last second
-		float acked_bandwidth;				// approximate acked bandwidth over the last second
-		float rtt;							// estimated round trip time
-		float rtt_maximum;					// maximum expected round trip time (hard coded to one second for the moment)
+		int GetHeaderSize() const
+		{
+			const int width = ack_bits_width(offeredOptions);
+			return 4 + ((offeredOptions & CompactHeaderOption) ? compact_header_max_size(width) : reliability_header_size(width));
+		}
 
-		std::vector<unsigned int> acks;		// acked packets from last set of packet receives. cleared each update!
+	protected:
 
-		PacketQueue sentQueue;				// sent packets used to calculate sent bandwidth (kept until rtt_maximum)
-		PacketQueue pendingAckQueue;		// sent packets which have not been acked yet (kept until rtt_maximum * 2 )
-		PacketQueue receivedQueue;			// received packets for determining acks to send (kept up to most recent recv sequence - 32)
-		PacketQueue ackedQueue;				// acked packets (kept until rtt_maximum * 2)
-	};
+		// a session started or ended, e.g. to attach and free its user data
 
-	// connection with reliability (seq/ack)
+		virtual void OnSessionStart(Session& /*session*/) {}
+		virtual void OnSessionEnd(Session& /*session*/) {}
 
-	class ReliableConnection : public Connection
-	{
-	public:
+	private:
 
-		ReliableConnection(unsigned int protocolId, float timeout, unsigned int max_sequence = 0xFFFFFFFF)
-			: Connection(protocolId, timeout), reliabilitySystem(max_sequence)
+		enum
 		{
-			ClearData();
-#ifdef NET_UNIT_TEST
-			packet_loss_mask = 0;
-#endif
-		}
+			ReliabilityHeaderSize = 12,		// the full header with 32 ack bits, the smallest full header
+			HeaderBufferSize = CompactHeaderMaxSize > ReliabilityHeaderMaxSize ? CompactHeaderMaxSize : ReliabilityHeaderMaxSize
+		};
 
-		~ReliableConnection()
+		// validate a datagram, find or start its session and run it through the session's reliability system
+		//  + copies up to size bytes of payload into data and returns the payload size, zero if there is none
+
+		int ProcessPacket(const Address& sender, const unsigned char packet[], int bytes_read, long long receive_time,
+			Session*& session, unsigned char data[], int size)
 		{
-			if (IsRunning())
-				Stop();
+			int headerSize = 0;
+			const int payload = ProcessHeader(sender, packet, bytes_read, receive_time, session, headerSize);
+			if (payload <= 0)
+				return 0;
+			const int bytes = payload < size ? payload : size;
+			std::memcpy(data, packet + headerSize, bytes);
+			return bytes;
 		}
 
-		// overriden functions from "Connection"
+		// as ProcessPacket, from the first 4 + HeaderBufferSize bytes of the packet (MaxControlSize for control packets),
+		// returns the payload size and sets headerSize to the bytes in front of it
 
-		bool SendPacket(const unsigned char data[], int size)
+		int ProcessHeader(const Address& sender, const unsigned char packet[], int bytes_read, long long receive_time, Session*& session, int& headerSize)
 		{
-#ifdef NET_UNIT_TEST
-			if (reliabilitySystem.GetLocalSequence() & packet_loss_mask)
+			if (is_control(packet, bytes_read, protocolId))
 			{
-				reliabilitySystem.PacketSent(size);
-				return true;
+				// answer path mtu probes from known clients only, so strangers cannot use us as a reflector
+				if (packet[4] == ProbeRequest && FindSession(sender))
+				{
+					unsigned char reply[ControlHeaderSize];
+					write_control(reply, protocolId, ProbeReply, bytes_read);
+					transport->Send(sender, reply, ControlHeaderSize);
+				}
+				else if (handshake && bytes_read >= MaxControlSize)
+					ProcessHandshake(sender, packet);
+				return 0;
 			}
-#endif
-			const int header = 12;
-			unsigned char packet[PacketSizeHack];
-			unsigned int seq = reliabilitySystem.GetLocalSequence();
-			unsigned int ack = reliabilitySystem.GetRemoteSequence();
-			unsigned int ack_bits = reliabilitySystem.GenerateAckBits();
-			WriteHeader(packet, seq, ack, ack_bits);
-			std::memcpy(packet + header, data, size);
-			if (!Connection::SendPacket(packet, size + header))
-				return false;
-			reliabilitySystem.PacketSent(size);
-			return true;
-		}
-
-		int ReceivePacket(unsigned char data[], int size)
-		{
-			const int header = 12;
-			if (size <= header)
-				return false;
-			unsigned char packet[PacketSizeHack];
-			int received_bytes = Connection::ReceivePacket(packet, size + header);
-			if (received_bytes == 0)
-				return false;
-			if (received_bytes <= header)
-				return false;
+			if (bytes_read <= 4 + ((offeredOptions & CompactHeaderOption) ? CompactHeaderMinSize : ReliabilityHeaderSize))
+				return 0;
+			if (packet[0] != (unsigned char)(protocolId >> 24) ||
+				packet[1] != (unsigned char)((protocolId >> 16) & 0xFF) ||
+				packet[2] != (unsigned char)((protocolId >> 8) & 0xFF) ||
+				packet[3] != (unsigned char)(protocolId & 0xFF))
+				return 0;
+			session = FindSession(sender);
+			if (!session)
+			{
+				// with the handshake strangers cost no more than this lookup
+				if (handshake)
+					return 0;
+				session = StartSession(sender, 0);
+				if (!session)
+					return 0;
+			}
+			ReliabilitySystem& reliability = session->reliabilitySystem;
+			const int width = ack_bits_width(session->options);
 			unsigned int packet_sequence = 0;
 			unsigned int packet_ack = 0;
-			unsigned int packet_ack_bits = 0;
-			ReadHeader(packet, packet_sequence, packet_ack, packet_ack_bits);
-			reliabilitySystem.PacketReceived(packet_sequence, received_bytes - header);
-			reliabilitySystem.ProcessAck(packet_ack, packet_ack_bits);
-			std::memcpy(data, packet + header, received_bytes - header);
-			return received_bytes - header;
-		}
-
-		void Update(float deltaTime)
-		{
-			Connection::Update(deltaTime);
-			reliabilitySystem.Update(deltaTime);
-		}
-
-		int GetHeaderSize() const
-		{
-			return Connection::GetHeaderSize() + reliabilitySystem.GetHeaderSize();
-		}
-
-		ReliabilitySystem& GetReliabilitySystem()
-		{
-			return reliabilitySystem;
+			AckBits packet_ack_bits;
+			headerSize = 4 + reliability_header_size(width);
+			if (session->options & CompactHeaderOption)
+				headerSize = 4 + read_compact_header(packet + 4, bytes_read - 4, packet_sequence, packet_ack, packet_ack_bits,
+					width, reliability.GetRemoteSequence(), reliability.GetLocalSequence(), max_sequence);
+			else if (bytes_read > headerSize)
+				read_reliability_header(packet + 4, packet_sequence, packet_ack, packet_ack_bits, width);
+			if (headerSize == 4 || bytes_read <= headerSize)
+				return 0;
+			session->lastReceiveTime = wheel.GetTime();
+			UpdateReliability(*session);
+			const int payload = bytes_read - headerSize;
+			session->reliabilitySystem.PacketReceived(packet_sequence, payload);
+			session->reliabilitySystem.ProcessAck(packet_ack, packet_ack_bits, receive_time);
+			ScheduleExpiry(*session);
+			return payload;
 		}
 
-		// unit test controls
+		// a session for a new client with the options agreed with it, NULL once maxSessions are active
 
-#ifdef NET_UNIT_TEST
-		void SetPacketLossMask(unsigned int mask)
+		Session* StartSession(const Address& sender, unsigned int options)
 		{
-			packet_loss_mask = mask;
+			if (sessions.GetCount() >= maxSessions)
+				return NULL;
+			printf("session started with %d.%d.%d.%d:%d\n",
+				sender.GetA(), sender.GetB(), sender.GetC(), sender.GetD(), sender.GetPort());
+			Session* session = new Session(sender, max_sequence);
+			session->options = options;
+			session->reliabilitySystem.SetBandwidthWindow(bandwidthWindow);
+			session->lastUpdateTime = wheel.GetTime();
+			sessions.Insert(sender, session);
+			wheel.Schedule(session->timeoutTimer, timeout);
+			OnSessionStart(*session);
+			return session;
 		}
-#endif
-
-	protected:
 
-		void WriteInteger(unsigned char* data, unsigned int value)
-		{
-			data[0] = (unsigned char)(value >> 24);
-			data[1] = (unsigned char)((value >> 16) & 0xFF);
-			data[2] = (unsigned char)((value >> 8) & 0xFF);
-			data[3] = (unsigned char)(value & 0xFF);
-		}
+		// server side of the connect handshake, see Connection::ProcessHandshake
 
-		void WriteHeader(unsigned char* header, unsigned int sequence, unsigned int ack, unsigned int ack_bits)
+		void ProcessHandshake(const Address& sender, const unsigned char packet[])
 		{
-			WriteInteger(header, sequence);
-			WriteInteger(header + 4, ack);
-			WriteInteger(header + 8, ack_bits);
+			if (packet[4] == ConnectRequest)
+			{
+				unsigned char reply[MaxControlSize];
+				write_control(reply, protocolId, ConnectChallenge, MaxControlSize);
+				cookies.Write(reply + ControlHeaderSize, sender, protocolId);
+				transport->Send(sender, reply, MaxControlSize);
+			}
+			else if (packet[4] == ConnectResponse && cookies.Check(packet + ControlHeaderSize, sender, protocolId))
+			{
+				Session* session = FindSession(sender);
+				if (!session)
+					session = StartSession(sender, (((unsigned int)packet[5] << 8) | packet[6]) & offeredOptions);
+				if (!session)
+					return;
+				session->lastReceiveTime = wheel.GetTime();
+				unsigned char reply[ControlHeaderSize];
+				write_control(reply, protocolId, ConnectAccept, session->options);
+				transport->Send(sender, reply, ControlHeaderSize);
+			}
 		}
 
-		void ReadInteger(const unsigned char* data, unsigned int& value)
-		{
-			value = (((unsigned int)data[0] << 24) | ((unsigned int)data[1] << 16) |
-				((unsigned int)data[2] << 8) | ((unsigned int)data[3]));
-		}
+		// catch the session's reliability system up with the time passed since it was last updated
 
-		void ReadHeader(const unsigned char* header, unsigned int& sequence, unsigned int& ack, unsigned int& ack_bits)
+		void UpdateReliability(Session& session)
 		{
-			ReadInteger(header, sequence);
-			ReadInteger(header + 4, ack);
-			ReadInteger(header + 8, ack_bits);
+			const double now = wheel.GetTime();
+			if (now == session.lastUpdateTime)
+				return;
+			session.reliabilitySystem.Update((float)(now - session.lastUpdateTime));
+			session.lastUpdateTime = now;
 		}
 
-		virtual void OnStop()
-		{
-			ClearData();
-		}
+		// make sure the session is woken when its next queued packet expires (and may count as lost)
 
-		virtual void OnDisconnect()
+		void ScheduleExpiry(Session& session)
 		{
-			ClearData();
+			if (session.expiryTimer.IsScheduled())
+				return;
+			const float expiry = session.reliabilitySystem.GetNextExpiry();
+			if (expiry >= 0.0f)
+				wheel.Schedule(session.expiryTimer, expiry);
 		}
 
-	private:
-
-		void ClearData()
+		void EndSession(Session* session)
 		{
-			reliabilitySystem.Reset();
+			wheel.Cancel(session->timeoutTimer);
+			wheel.Cancel(session->expiryTimer);
+			sessions.Erase(session->address);
+			OnSessionEnd(*session);
+			delete session;
 		}
 
-#ifdef NET_UNIT_TEST
-		unsigned int packet_loss_mask;			// mask sequence number, if non-zero, drop packet - for unit test only
-#endif
-
-		ReliabilitySystem reliabilitySystem;	// reliability system: manages sequence numbers and acks, tracks network stats etc.
+		unsigned int protocolId;
+		float timeout;
+		int maxSessions;
+		unsigned int max_sequence;
+		bool running;
+		Socket socket;
+		Transport* transport;						// datagram io goes through here, normally &socket
+		int maxPacketSize;							// largest datagram sent or received
+		bool handshake;								// sessions start only from a returned connect cookie
+		CookieSecret cookies;
+		unsigned int offeredOptions;				// options granted to clients that ask for them, see ConnectOption
+		float bandwidthWindow;						// bandwidth window of new sessions in seconds
+		std::vector<unsigned char> packetBuffer;	// one datagram, for single sends and receives
+		std::vector<unsigned char> batchBuffer;		// MaxPacketBatch datagrams, for ReceivePackets
+		AddressTable<Session*> sessions;			// active sessions by client address
+		std::vector<Session*> expired;				// sessions to end after a pass over the table or the timers
+		TimingWheel wheel;							// session timeouts and reliability queue expiry
 	};
 }
 
@@ -11,13 +11,44 @@
  *     Features:
  *     - Implements a reliable UDP connection for file transfer.
  *     - Uses flow control to adapt to network conditions.
- *     - Transfers file metadata and content in fixed-size packets.
+ *     - Transfers file content in packets sized to the path mtu found by probing.
+ *     - Optionally uses UDP segmentation offload (GSO/GRO) for bulk sends and receives.
+ *     - Serves many concurrent uploads from one server socket, one session per client.
+ *     - Admits clients through a stateless cookie handshake, ignoring spoofed senders.
+ *     - Agrees on a compact variable-length packet header in the handshake.
+ *     - Agrees on wide ack bitfields in the handshake for more packets in flight.
+ *     - Optionally shards the server across threads with SO_REUSEPORT sockets.
+ *     - Optionally busy-polls the event loop on a pinned core for minimum latency.
+ *     - Has the kernel pace packets out at the flow control rate instead of in bursts.
+ *     - Can run a whole transfer in one process over a seeded simulated network.
+ *     - Has loopback and in-memory benchmarks for the transport and reliability layers.
  *     - Computes and verifies CRC32 checksums to ensure data integrity.
  *     - Provides acknowledgments for better reliability.
  *
  *     Functions:
- *     - main()        : Handles client-server communication and file transfer logic.
- *     - crc32()       : Computes the CRC32 checksum for data integrity verification.
+ *     - main()               : Parses the command line, runs the client or starts the server.
+ *     - ReceiveFilePackets() : Drains received packets and hands each to ProcessFilePacket.
+ *     - ProcessFilePacket()  : Handles one received file metadata, data or CRC32 packet.
+ *     - RunServerShard()     : Runs the server, or one shard of it on a shared port.
+ *     - ConfigureSocket()    : Applies socket buffer sizes, drop accounting and the io backend.
+ *     - ConfigureServer()    : Applies socket options and the connect handshake to the server.
+ *     - ConfigureLoop()      : Applies busy polling and cpu pinning to an event loop.
+ *     - RunSimulation()      : Transfers a file from a client to the server over a simulated network.
+ *     - RunBenchmark()       : Runs the named benchmark.
+ *     - OpenBenchSockets()   : Opens the sender and receiver sockets the loopback benchmarks use.
+ *     - BenchRing()          : Compares io_uring and recvfrom receives on loopback.
+ *     - BenchConnected()     : Compares sends on a connected socket with sendto on loopback.
+ *     - DrainSocket()        : Discards every datagram waiting on a benchmark socket.
+ *     - BenchShards()        : Measures server receive throughput with 1, 2 and 4 port shards.
+ *     - RunBenchShard()      : Receives and counts packets on one benchmark shard.
+ *     - RunBenchClients()    : Sends packets to the benchmark shards from a group of clients.
+ *     - BenchZeroCopy()      : Compares copying and zero copy sends at several payload sizes.
+ *     - BenchLatency()       : Compares one-way latency of the sleep, event and busy-poll loops.
+ *     - RunBenchPinger()     : Sends timestamped datagrams at a steady rate for BenchLatency.
+ *     - BenchSessions()      : Compares AddressTable and std::map session lookups.
+ *     - BenchSegments()      : Compares gathered and scattered datagrams with staging copies.
+ *     - BenchReliability()   : Measures the reliability system's per packet bookkeeping.
+ *     - crc32()              : Computes the CRC32 checksum for data integrity verification.
  */
 
 #include <iostream>
@@ -25,6 +56,11 @@
 #include <string>
 #include <vector>
 #include <chrono>  // Include this header for accurate time measurement
+#include <thread>
+#include <atomic>
+#include <map>
+#include <unordered_map>
+#include <random>
 #include "Net.h"
 #pragma warning(disable: 4996)
 
@@ -40,7 +76,35 @@ const int ProtocolId = 0x11223344;
 const float DeltaTime = 1.0f / 30.0f;
 const float SendRate = 1.0f / 30.0f;
 const float TimeOut = 10.0f;
-const int PacketSize = 256;
+const int MaxClients = 256;	// concurrent uploads per server (or per shard), further clients are ignored until one ends
+const int PacketPoolSize = 16;	// receive buffers of the server, packets are processed in place and released
+const int PacketSize = 256;	// size of the metadata and CRC32 packets, file data uses the largest payload the path allows
+const bool UseHandshake = true;	// clients connect with a cookie handshake, the server keeps no state for unverified senders
+const bool UseCompactHeader = true;	// agree on the compact reliability header in the handshake, 8 instead of 16 header bytes per packet
+const int WideAckBits = 64;	// ack bits offered in the handshake (64, 128 or 256, 32 for none), so acks cover more packets in flight
+const bool UseRing = true;		// use the io_uring socket backend when built with NET_IO_URING
+const bool UseOffload = true;	// hand the kernel batches as GSO super-buffers and read GRO-coalesced buffers back
+const int SocketBufferSize = 1024 * 1024;	// kernel send/receive buffer, sized above the bandwidth-delay product
+const Connection::Pacing PacingMode = Connection::PacingRate;	// PacingTxTime stamps every packet but gives up offload and io_uring
+const int DatagramOverhead = 28;	// ipv4 + udp header bytes, counted by the kernel against the pacing rate
+const bool UseBusyPoll = false;	// spin in the event loop instead of sleeping, trades a whole core for receive latency
+const int BusyPollTime = 50;	// microseconds each receive may spin on the device queue (SO_BUSY_POLL)
+const int BusyPollCpu = -1;		// first core to pin busy-polling threads to (shards take the following ones), -1 to not pin
+const float SimulatedLatency = 0.05f;		// one-way delay of the simulated link in seconds
+const float SimulatedJitter = 0.01f;		// +/- variation of the delay in seconds
+const float SimulatedLoss = 1.0f;			// percent of packets lost
+const float SimulatedDuplicates = 0.5f;		// percent of packets delivered twice
+const float SimulatedReorder = 1.0f;		// percent of packets held back to arrive out of order
+const float SimulatedBandwidth = 1024.0f;	// link rate in kbps
+const int SimulatedMtu = 1400;				// largest datagram the simulated link carries
+const float SimulatedDrainTime = 2.0f;		// seconds of simulated time to keep running after the last send
+const int BenchPort = 30100;				// first loopback port the benchmarks bind, they use the few following it
+const int BenchDatagrams = 200000;			// datagrams per measured benchmark run
+const int BenchPayload = 256;				// datagram size of benchmarks that do not vary it
+const int BenchClients = 16;				// clients per sending thread of the shard benchmark
+const float BenchTime = 1.0f;				// seconds each timed benchmark run lasts
+const int BenchPings = 1000;				// timestamped datagrams per run of the latency benchmark
+const float BenchPingInterval = 0.001f;		// seconds between them
 
 class FlowControl
 {
@@ -132,8 +196,77 @@ private:
 	float penalty_reduction_accumulator;
 };
 
+// State of one file transfer, kept per client session so concurrent uploads never share it
+struct TransferState
+{
+	std::chrono::high_resolution_clock::time_point startTime;	// When the file started transmitting
+	size_t totalFileSize = 0;									// Total file size
+	string clientCrc;											// CRC32 reported by the client
+	vector<unsigned char> fileData;								// Received file data
+};
+
+// The file server: one session per uploading client, each with its own TransferState
+class FileServer : public ConnectionManager
+{
+public:
+
+	FileServer() : ConnectionManager(ProtocolId, TimeOut, MaxClients), pool(PacketPoolSize, GetMaxPacketSize())
+	{
+	}
+
+	~FileServer()
+	{
+		// end the sessions while OnSessionEnd still frees their transfers
+		if (IsRunning())
+			Stop();
+	}
+
+	static TransferState& GetTransfer(Session& session)
+	{
+		return *(TransferState*)session.GetUserData();
+	}
+
+	PacketPool pool;		// Buffers packets from any client are received into
+
+protected:
+
+	void OnSessionStart(Session& session)
+	{
+		TransferState* transfer = new TransferState();
+		transfer->startTime = std::chrono::high_resolution_clock::now();
+		session.SetUserData(transfer);
+	}
+
+	void OnSessionEnd(Session& session)
+	{
+		delete (TransferState*)session.GetUserData();
+		session.SetUserData(NULL);
+	}
+};
+
 //function prototype
 uint32_t crc32(const char* s, size_t n);
+void ReceiveFilePackets(FileServer& server);
+void ProcessFilePacket(FileServer& server, Session& session, unsigned char* packet, int bytes_read);
+void RunServerShard(int shard, bool shared);
+void ConfigureSocket(ReliableConnection& connection);
+void ConfigureServer(FileServer& server);
+void ConfigureLoop(Reactor& reactor, int cpu);
+int RunSimulation(const char* fileName, unsigned int seed);
+int RunBenchmark(const char* name);
+bool OpenBenchSockets(Socket& sender, Socket& receiver);
+int BenchRing();
+int BenchConnected();
+void DrainSocket(Socket& socket);
+int BenchShards();
+void RunBenchShard(atomic<bool>* running, atomic<int>* ready, atomic<long long>* processed);
+void RunBenchClients(int group, atomic<bool>* running);
+int BenchZeroCopy();
+int BenchLatency();
+void RunBenchPinger(Socket* sender, int count, atomic<bool>* done);
+int BenchSessions();
+int BenchSegments();
+int BenchReliability();
 
 int main(int argc, char* argv[])
 {
@@ -147,6 +280,19 @@ int main(int argc, char* argv[])
 	Mode mode = Client;
 	Address address;
 	const char* fileName = nullptr;
+	int shardCount = 1;
+
+	// Simulated transfer: client and server in this process, no real network involved
+	if (argc >= 3 && strcmp(argv[1], "-simulate") == 0)
+	{
+		return RunSimulation(argv[2], argc >= 4 ? (unsigned int)atoi(argv[3]) : 0);
+	}
+
+	// Benchmark: measures one part of the transport or reliability layer and prints the result
+	if (argc >= 3 && strcmp(argv[1], "-bench") == 0)
+	{
+		return RunBenchmark(argv[2]);
+	}
 
 	if (argc >= 3)
 	{
@@ -162,8 +308,15 @@ int main(int argc, char* argv[])
 	else if (argc == 1) {
 		mode = Server;
 	}
+	else if (argc == 2 && strchr(argv[1], '.') == nullptr && atoi(argv[1]) > 0) {
+		mode = Server;
+		shardCount = atoi(argv[1]); // Number of SO_REUSEPORT shards
+	}
 	else {
 		printf("Usage: <IP ADDRESS> <FILE NAME>\n");
+		printf("       [SERVER SHARD COUNT]\n");
+		printf("       -simulate <FILE NAME> [SEED]\n");
+		printf("       -bench <ring|connected|shards|zerocopy|latency|sessions|segments|reliability>\n");
 		return 1;
 	}
 
@@ -174,25 +327,62 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
+	// Server: every client gets its own session on the one socket. Sharded, each shard is a thread
+	// with its own socket on the port and the kernel spreads clients across them
+	if (mode == Server)
+	{
+		if (shardCount > 1)
+		{
+			printf("starting %d server shards on port %d\n", shardCount, ServerPort);
+			vector<thread> shards;
+			for (int shard = 0; shard < shardCount; ++shard)
+				shards.push_back(thread(RunServerShard, shard, true));
+			for (size_t shard = 0; shard < shards.size(); ++shard)
+				shards[shard].join();
+		}
+		else
+		{
+			RunServerShard(0, false);
+		}
+		ShutdownSockets();
+		return 0;
+	}
+
 	ReliableConnection connection(ProtocolId, TimeOut);
-	const int port = mode == Server ? ServerPort : ClientPort;
 
-	if (!connection.Start(port))
+	if (!connection.Start(ClientPort))
 	{
-		printf("could not start connection on port %d\n", port);
+		printf("could not start connection on port %d\n", ClientPort);
 		return 1;
 	}
 
-	if (mode == Client)
+	ConfigureSocket(connection);
+
+	// The client probes for the largest packet the path carries, the server only has to answer probes
+	if (!connection.EnablePathMtuDiscovery())
+		printf("path mtu discovery unavailable, sending %d byte packets\n", connection.GetPathMtu());
+
+	// Wake on packet arrival or on the DeltaTime tick, whichever comes first
+	Reactor reactor;
+	if (!reactor.Open(connection.GetHandle(), DeltaTime))
 	{
-		connection.Connect(address);
+		printf("could not start event loop\n");
+		return 1;
 	}
-	else
+
+	ConfigureLoop(reactor, BusyPollCpu);
+
+	// Must come before Connect, the handshake starts with it
+	if (UseHandshake)
 	{
-		// If mode is "server" listen
-		connection.Listen();
+		connection.EnableHandshake();
+		if (UseCompactHeader)
+			connection.EnableCompactHeader();
+		if (WideAckBits > 32)
+			connection.EnableWideAcks(WideAckBits);
 	}
-		
+
+	connection.Connect(address);
 
 	bool connected = false;
 	float sendAccumulator = 0.0f;
@@ -200,26 +390,28 @@ int main(int argc, char* argv[])
 
 	FlowControl flowControl;
 
-	// Add a variable to track the start time of the transfer
-	std::chrono::high_resolution_clock::time_point transferStartTime;
-	size_t totalFileSize = 0;  // To store the total file size
+	// Tracks the start time, size and received data of the transfer
+	TransferState transfer;
+
+	std::chrono::steady_clock::time_point lastTime = std::chrono::steady_clock::now();
 
 	while (true)
 	{
+		// Real time elapsed since the previous wakeup (timer tick or packet arrival)
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		const float deltaTime = std::chrono::duration<float>(now - lastTime).count();
+		lastTime = now;
+
 		// update flow control
 		if (connection.IsConnected())
-			flowControl.Update(DeltaTime, connection.GetReliabilitySystem().GetRoundTripTime() * 1000.0f);
+			flowControl.Update(deltaTime, connection.GetReliabilitySystem().GetRoundTripTime() * 1000.0f);
 
 		const float sendRate = flowControl.GetSendRate();
 
-		// detect changes in connection state
-		if (mode == Server && connected && !connection.IsConnected())
-		{
-			flowControl.Reset();
-			printf("reset flow control\n");
-			connected = false;
-		}
+		// the kernel spreads packets out at the flow control rate rather than letting each tick's batch go as a burst
+		connection.SetPacingRate((int)(sendRate * (connection.GetPathMtu() + DatagramOverhead)));
 
+		// detect changes in connection state
 		if (!connected && connection.IsConnected())
 		{
 			printf("client connected to server\n");
@@ -233,9 +425,11 @@ int main(int argc, char* argv[])
 		}
 	
 		// send and receive packets
-		sendAccumulator += DeltaTime;
+		sendAccumulator += deltaTime;
 
-		if (mode == Client) {
+		// With the handshake the server only takes packets once it has connected us
+		if (connected || !connection.IsHandshakeEnabled())
+		{
 			// Open file for reading
 			ifstream file(fileName, ios::binary | ios::ate);
 			if (!file) {
@@ -245,44 +439,69 @@ int main(int argc, char* argv[])
 
 			size_t fileSize = file.tellg();
 			file.seekg(0, ios::beg);
-			size_t totalPackets = (fileSize / PacketSize) + ((fileSize % PacketSize) ? 1 : 0);
 
 			// Record the start time when the file starts transmitting
-			transferStartTime = std::chrono::high_resolution_clock::now();
+			transfer.startTime = std::chrono::high_resolution_clock::now();
+			transfer.totalFileSize = fileSize;
 
-			// Send first packet (File Metadata)
+			// Send first packet (File Metadata), with the size in bytes since the packet count changes as path mtu discovery raises the payload size
 			unsigned char metadataPacket[PacketSize];
 			memset(metadataPacket, 0, PacketSize);
-			snprintf((char*)metadataPacket, PacketSize, "File|%zu|%s", totalPackets, fileName);
+			snprintf((char*)metadataPacket, PacketSize, "File|%zu|%s", fileSize, fileName);
 			connection.SendPacket(metadataPacket, PacketSize);
 
-			cout << "Sending file: " << fileName << " (" << fileSize << " bytes) in " << totalPackets << " packets.\n";
+			cout << "Sending file: " << fileName << " (" << fileSize << " bytes).\n";
 
-			char buffer[PacketSize];
-			size_t packetIndex = 0;
+			// File chunks due this tick are gathered and sent as one batch, each as large as the path allows
+			const int chunkCapacity = connection.GetMaxPacketSize();
+			vector<unsigned char> buffers(MaxPacketBatch * chunkCapacity);
+			const unsigned char* chunks[MaxPacketBatch];
+			int chunkSizes[MaxPacketBatch];
+			size_t fileOffset = 0;
 
-			while (true) {
-				sendAccumulator += DeltaTime;
-
-				while (sendAccumulator > 1.0f / sendRate && packetIndex < totalPackets) {
-					memset(buffer, 0, PacketSize);
-					file.read(buffer, PacketSize);
-					connection.SendPacket((unsigned char*)buffer, PacketSize);
+			std::chrono::steady_clock::time_point sendTime = std::chrono::steady_clock::now();
 
-					packetIndex++;
-					sendAccumulator -= 1.0f / sendRate;
+			while (true) {
+				std::chrono::steady_clock::time_point sendNow = std::chrono::steady_clock::now();
+				const float sendDelta = std::chrono::duration<float>(sendNow - sendTime).count();
+				sendTime = sendNow;
+				sendAccumulator += sendDelta;
+
+				while (sendAccumulator > 1.0f / sendRate && fileOffset < fileSize) {
+					const int chunkSize = connection.GetMaxPayloadSize();
+					int chunkCount = 0;
+					while (chunkCount < MaxPacketBatch && sendAccumulator > 1.0f / sendRate && fileOffset < fileSize) {
+						unsigned char* chunk = &buffers[chunkCount * chunkCapacity];
+						file.read((char*)chunk, chunkSize);
+						chunks[chunkCount] = chunk;
+						chunkSizes[chunkCount] = (int)file.gcount();
+						chunkCount++;
+
+						fileOffset += file.gcount();
+						sendAccumulator -= 1.0f / sendRate;
+					}
+					connection.SendPackets(chunks, chunkSizes, chunkCount);
 				}
 
-				if (packetIndex >= totalPackets) {
+				if (fileOffset >= fileSize) {
 					cout << "File transmission complete. Waiting for server acknowledgment...\n";
 					break;
 				}
 
-				connection.Update(DeltaTime);
-				net::wait(DeltaTime);
+				connection.Update(sendDelta);
+
+				// Sleep until the next send tick or reliability deadline, processing acks as soon as they arrive
+				reactor.SetDeadline(connection.GetReliabilitySystem().GetNextExpiry());
+				if (reactor.Wait() & Reactor::Readable) {
+					unsigned char ackPacket[PacketSize];
+					while (connection.ReceivePacket(ackPacket, sizeof(ackPacket)) > 0);
+				}
 			}
 			file.close();
 
+			// The send loop already advanced the connection to sendTime, the next deltaTime must not count that time again
+			lastTime = sendTime;
+
 			// Reopen file for CRC32 calculation (reset file pointer)
 			file.open(fileName, ios::binary);
 			if (!file) {
@@ -312,74 +531,18 @@ int main(int argc, char* argv[])
 
 			// After the transfer is complete, calculate the time taken and the transfer speed
 			auto transferEndTime = std::chrono::high_resolution_clock::now();
-			std::chrono::duration<float> transferDuration = transferEndTime - transferStartTime;
+			std::chrono::duration<float> transferDuration = transferEndTime - transfer.startTime;
 			// Calculate the transfer speed in Mbps
 			float transferTimeInSeconds = transferDuration.count(); // Time in seconds
-			float transferSpeedMbps = (totalFileSize * 8.0f) / (transferTimeInSeconds * 1000000.0f); // Convert bytes to bits and calculate speed
+			float transferSpeedMbps = (transfer.totalFileSize * 8.0f) / (transferTimeInSeconds * 1000000.0f); // Convert bytes to bits and calculate speed
 			// Display the transfer speed
 			cout << "Transfer completed in " << transferTimeInSeconds << " seconds.\n";
 			cout << "Transfer speed: " << transferSpeedMbps << " Mbps\n";
 		}
 
-
-		// SERVER
-		while (true)
-		{
-			unsigned char packet[PacketSize];
-			int bytes_read = connection.ReceivePacket(packet, sizeof(packet));
-			if (bytes_read == 0)
-				break;
-
-			// Validate the received packet
-			printf("Received packet: %s\n", packet);
-
-			static string clientCrc;
-			unsigned long serverCrc = 0xFFFFFFFF;  // Initial CRC value for CRC32
-			static vector<unsigned char> fileData; // To store the received file data
-
-			if (strncmp((char*)packet, "File|", 5) == 0)
-			{
-				printf("Received file metadata. Sending ACK.\n");
-				string ack = "ACK_FILE_INFO"; // Send ACK to client that file successfully 
-				connection.SendPacket((unsigned char*)ack.c_str(), ack.size() + 1);
-			}
-			else if (strncmp((char*)packet, "CRC32|", 6) == 0)
-			{
-				// Extract the CRC32 from the packet
-				clientCrc = string((char*)packet);
-				clientCrc = clientCrc.substr(6); // Extract the CRC32 value (remove "CRC32|" prefix)
-				printf("Received file CRC32: %s\n", clientCrc.c_str());
-
-				// Calculate CRC32 on the server-side from accumulated file data
-				serverCrc = crc32((const char*)fileData.data(), fileData.size()); // Correct CRC calculation
-			}
-			else
-			{
-				// Accumulate file data
-				fileData.insert(fileData.end(), packet, packet + bytes_read); // Store the received file data
-			}
-
-			// Final comparison between client and server CRC32
-			if (!clientCrc.empty()) {
-				printf("Server CRC32: %08lX\n", serverCrc);
-				if (clientCrc == std::to_string(serverCrc)) {
-					printf("File transfer successful! CRC32 matched.\n");
-				}
-				else {
-					printf("File transfer failed! CRC32 mismatch.\n");
-				}
-			}
-
-			// After the transfer is complete, calculate the time taken and the transfer speed
-			auto transferEndTime = std::chrono::high_resolution_clock::now();
-			std::chrono::duration<float> transferDuration = transferEndTime - transferStartTime;
-			// Calculate the transfer speed in Mbps
-			float transferTimeInSeconds = transferDuration.count(); // Time in seconds
-			float transferSpeedMbps = (totalFileSize * 8.0f) / (transferTimeInSeconds * 1000000.0f); // Convert bytes to bits and calculate speed
-			// Display the transfer speed
-			cout << "Transfer completed in " << transferTimeInSeconds << " seconds.\n";
-			cout << "Transfer speed: " << transferSpeedMbps << " Mbps\n";
-		}
+		// Acknowledgments from the server
+		unsigned char ackPacket[PacketSize];
+		while (connection.ReceivePacket(ackPacket, sizeof(ackPacket)) > 0);
 
 		// show packets that were acked this frame
 
@@ -397,10 +560,10 @@ int main(int argc, char* argv[])
 		#endif
 
 		// update connection
-		connection.Update(DeltaTime);
+		connection.Update(deltaTime);
 
 		// show connection stats
-		statsAccumulator += DeltaTime;
+		statsAccumulator += deltaTime;
 
 		while (statsAccumulator >= 0.25f && connection.IsConnected())
 		{
@@ -409,24 +572,1087 @@ int main(int argc, char* argv[])
 			unsigned int sent_packets = connection.GetReliabilitySystem().GetSentPackets();
 			unsigned int acked_packets = connection.GetReliabilitySystem().GetAckedPackets();
 			unsigned int lost_packets = connection.GetReliabilitySystem().GetLostPackets();
+			unsigned int dropped_packets = connection.GetDroppedPackets();
 
 			float sent_bandwidth = connection.GetReliabilitySystem().GetSentBandwidth();
 			float acked_bandwidth = connection.GetReliabilitySystem().GetAckedBandwidth();
 
-			printf("rtt %.1fms, sent %d, acked %d, lost %d (%.1f%%), sent bandwidth = %.1fkbps, acked bandwidth = %.1fkbps\n",
+			printf("rtt %.1fms, sent %d, acked %d, lost %d (%.1f%%), dropped locally %d, sent bandwidth = %.1fkbps, acked bandwidth = %.1fkbps\n",
 				rtt * 1000.0f, sent_packets, acked_packets, lost_packets,
 				sent_packets > 0.0f ? (float)lost_packets / (float)sent_packets * 100.0f : 0.0f,
-				sent_bandwidth, acked_bandwidth);
+				dropped_packets, sent_bandwidth, acked_bandwidth);
 
 			statsAccumulator -= 0.25f;
 		}
 
-		net::wait(DeltaTime);
+		// Wake before the tick if a sent packet leaves the ack window sooner
+		reactor.SetDeadline(connection.GetReliabilitySystem().GetNextExpiry());
+		reactor.Wait();
 	}
 
 	return 0;
 }
 
+/*
+ * FUNCTION   : ReceiveFilePackets
+ * DESCRIPTION: Drains every packet waiting on the server and processes each one as part of
+ *              the file transfer of the client that sent it. Payloads are received straight
+ *              into pooled buffers and processed in place.
+ * PARAMETERS :
+ *   - server : The server to receive from.
+ * RETURNS    :
+ *   - Nothing.
+ */
+void ReceiveFilePackets(FileServer& server)
+{
+	Session* session = nullptr;
+	PooledPacket packet;
+	while (server.ReceivePooledPacket(server.pool, session, packet) > 0)
+	{
+		ProcessFilePacket(server, *session, packet.data, packet.size);
+		server.pool.Release(packet);
+	}
+}
+
+/*
+ * FUNCTION   : ProcessFilePacket
+ * DESCRIPTION: Handles one received packet: records the file size from the metadata and
+ *              acknowledges it, accumulates file data and verifies the final CRC32 against
+ *              the received data.
+ * PARAMETERS :
+ *   - server     : The server the packet arrived on.
+ *   - session    : Session of the client that sent the packet.
+ *   - packet     : The received payload.
+ *   - bytes_read : Size of the payload in bytes.
+ * RETURNS    :
+ *   - Nothing.
+ */
+void ProcessFilePacket(FileServer& server, Session& session, unsigned char* packet, int bytes_read)
+{
+	TransferState& transfer = FileServer::GetTransfer(session);
+
+	// Validate the received packet
+	printf("Received packet: %s\n", packet);
+
+	unsigned long serverCrc = 0xFFFFFFFF;  // Initial CRC value for CRC32
+
+	if (strncmp((char*)packet, "File|", 5) == 0)
+	{
+		// File|<size in bytes>|<name>
+		transfer.totalFileSize = strtoull((char*)packet + 5, nullptr, 10);
+		printf("Received file metadata. Sending ACK.\n");
+		string ack = "ACK_FILE_INFO"; // Send ACK to client that file successfully 
+		server.SendPacket(session, (unsigned char*)ack.c_str(), ack.size() + 1);
+	}
+	else if (strncmp((char*)packet, "CRC32|", 6) == 0)
+	{
+		// Extract the CRC32 from the packet
+		transfer.clientCrc = string((char*)packet);
+		transfer.clientCrc = transfer.clientCrc.substr(6); // Extract the CRC32 value (remove "CRC32|" prefix)
+		printf("Received file CRC32: %s\n", transfer.clientCrc.c_str());
+
+		// Calculate CRC32 on the server-side from accumulated file data
+		serverCrc = crc32((const char*)transfer.fileData.data(), transfer.fileData.size()); // Correct CRC calculation
+	}
+	else
+	{
+		// Accumulate file data
+		transfer.fileData.insert(transfer.fileData.end(), packet, packet + bytes_read); // Store the received file data
+	}
+
+	// Final comparison between client and server CRC32
+	if (!transfer.clientCrc.empty()) {
+		printf("Server CRC32: %08lX\n", serverCrc);
+		if (transfer.clientCrc == std::to_string(serverCrc)) {
+			printf("File transfer successful! CRC32 matched.\n");
+		}
+		else {
+			printf("File transfer failed! CRC32 mismatch.\n");
+		}
+	}
+
+	// After the transfer is complete, calculate the time taken and the transfer speed
+	auto transferEndTime = std::chrono::high_resolution_clock::now();
+	std::chrono::duration<float> transferDuration = transferEndTime - transfer.startTime;
+	// Calculate the transfer speed in Mbps
+	float transferTimeInSeconds = transferDuration.count(); // Time in seconds
+	float transferSpeedMbps = (transfer.totalFileSize * 8.0f) / (transferTimeInSeconds * 1000000.0f); // Convert bytes to bits and calculate speed
+	// Display the transfer speed
+	cout << "Transfer completed in " << transferTimeInSeconds << " seconds.\n";
+	cout << "Transfer speed: " << transferSpeedMbps << " Mbps\n";
+}
+
+/*
+ * FUNCTION   : RunServerShard
+ * DESCRIPTION: Runs the server, or one shard of the sharded server, until the process exits.
+ *              Each client gets its own session and transfer state on the shard's socket. A
+ *              shared shard binds an SO_REUSEPORT socket on ServerPort and serves the clients
+ *              the kernel hashes to it.
+ * PARAMETERS :
+ *   - shard  : Index of this shard, used in log output and cpu pinning.
+ *   - shared : Whether the port is shared with other shards.
+ * RETURNS    :
+ *   - Nothing.
+ */
+void RunServerShard(int shard, bool shared)
+{
+	FileServer server;
+
+	if (!server.Start(ServerPort, shared))
+	{
+		printf("shard %d could not start on port %d\n", shard, ServerPort);
+		return;
+	}
+
+	ConfigureServer(server);
+
+	Reactor reactor;
+	if (!reactor.Open(server.GetHandle(), DeltaTime))
+	{
+		printf("shard %d could not start event loop\n", shard);
+		return;
+	}
+
+	ConfigureLoop(reactor, BusyPollCpu < 0 ? -1 : BusyPollCpu + shard);
+
+	float statsAccumulator = 0.0f;
+	std::chrono::steady_clock::time_point lastTime = std::chrono::steady_clock::now();
+
+	while (true)
+	{
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		const float deltaTime = std::chrono::duration<float>(now - lastTime).count();
+		lastTime = now;
+
+		ReceiveFilePackets(server);
+
+		// Ages every session, clients silent for TimeOut seconds are dropped with their transfer
+		server.Update(deltaTime);
+
+		statsAccumulator += deltaTime;
+
+		while (statsAccumulator >= 0.25f && server.GetSessionCount() > 0)
+		{
+			printf("shard %d: %d clients, dropped locally %d\n", shard, server.GetSessionCount(), server.GetDroppedPackets());
+
+			statsAccumulator -= 0.25f;
+		}
+
+		// Wake before the tick if a session timer falls due sooner
+		reactor.SetDeadline(server.GetNextExpiry(DeltaTime));
+		reactor.Wait();
+	}
+}
+
+/*
+ * FUNCTION   : ConfigureSocket
+ * DESCRIPTION: Applies the socket options shared by every connection: kernel buffer sizes,
+ *              receive queue drop accounting, kernel pacing, and the io_uring or segmentation
+ *              offload backend.
+ * PARAMETERS :
+ *   - connection : A started connection.
+ * RETURNS    :
+ *   - Nothing.
+ */
+void ConfigureSocket(ReliableConnection& connection)
+{
+	if (connection.SetBufferSizes(SocketBufferSize, SocketBufferSize))
+	{
+		printf("socket buffers: receive %d bytes, send %d bytes\n",
+			connection.GetReceiveBufferSize(), connection.GetSendBufferSize());
+	}
+
+	// Lets the stats tell local receive queue overflow apart from network loss
+	connection.EnableDropAccounting();
+
+	// Kernel receive timestamps give rtt samples independent of our loop timing
+	connection.EnableTimestamps();
+
+	if (UseBusyPoll)
+		connection.EnableBusyPoll(BusyPollTime);
+
+	// Must come before the io backend, transmit times rule out offload and io_uring
+	if (PacingMode != Connection::PacingOff && !connection.EnablePacing(PacingMode))
+		printf("kernel pacing unavailable, sending in bursts\n");
+
+	if (UseRing && connection.EnableRing())
+	{
+		// io_uring already batches sends and harvests receives without syscalls
+	}
+	else if (UseOffload && !connection.EnableOffload())
+	{
+		printf("segmentation offload unavailable, using per-datagram io\n");
+	}
+}
+
+/*
+ * FUNCTION   : ConfigureServer
+ * DESCRIPTION: Applies the socket options the server supports: kernel buffer sizes, receive
+ *              queue drop accounting, receive timestamps and busy polling. Also requires
+ *              clients to connect through the cookie handshake when UseHandshake is set,
+ *              offering them compact packet headers when UseCompactHeader is set and ack
+ *              bits WideAckBits wide.
+ * PARAMETERS :
+ *   - server : A started server.
+ * RETURNS    :
+ *   - Nothing.
+ */
+void ConfigureServer(FileServer& server)
+{
+	if (server.SetBufferSizes(SocketBufferSize, SocketBufferSize))
+		printf("socket buffers: %d bytes\n", SocketBufferSize);
+
+	server.EnableDropAccounting();
+	server.EnableTimestamps();
+
+	if (UseBusyPoll)
+		server.EnableBusyPoll(BusyPollTime);
+
+	if (UseHandshake)
+	{
+		server.EnableHandshake();
+		if (UseCompactHeader)
+			server.EnableCompactHeader();
+		if (WideAckBits > 32)
+			server.EnableWideAcks(WideAckBits);
+	}
+}
+
+/*
+ * FUNCTION   : ConfigureLoop
+ * DESCRIPTION: Switches an event loop to busy polling when UseBusyPoll is set, and pins the
+ *              calling thread to a core so the spinning loop does not migrate or share it.
+ * PARAMETERS :
+ *   - reactor : The opened event loop of the calling thread.
+ *   - cpu     : Core to pin the calling thread to, -1 to leave it to the scheduler.
+ * RETURNS    :
+ *   - Nothing.
+ */
+void ConfigureLoop(Reactor& reactor, int cpu)
+{
+	if (!UseBusyPoll)
+		return;
+
+	reactor.SetBusyPoll(true);
+	printf("busy polling event loop\n");
+
+	if (cpu >= 0 && pin_thread(cpu))
+		printf("event loop pinned to cpu %d\n", cpu);
+}
+
+/*
+ * FUNCTION   : RunSimulation
+ * DESCRIPTION: Runs a complete file transfer between a client connection and the server in
+ *              this process, over a simulated network with the Simulated* impairments. Time
+ *              is virtual and advanced DeltaTime per step, so the run is as fast as the cpu
+ *              allows and the same seed always reproduces the same transfer.
+ * PARAMETERS :
+ *   - fileName : The file to transfer.
+ *   - seed     : Seed of the simulated network's random decisions.
+ * RETURNS    :
+ *   - 0 when the transfer ran, 1 on error.
+ */
+int RunSimulation(const char* fileName, unsigned int seed)
+{
+	ifstream file(fileName, ios::binary);
+	if (!file) {
+		cerr << "Error: Cannot open file.\n";
+		return 1;
+	}
+	vector<unsigned char> fileContents((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+	SimulatedNetwork network(seed);
+	network.SetLatency(SimulatedLatency, SimulatedJitter);
+	network.SetLoss(SimulatedLoss);
+	network.SetDuplicates(SimulatedDuplicates);
+	network.SetReorder(SimulatedReorder, SimulatedLatency);
+	network.SetBandwidth(SimulatedBandwidth);
+	network.SetMtu(SimulatedMtu);
+
+	SimulatedSocket clientSocket(network);
+	SimulatedSocket serverSocket(network);
+	ReliableConnection client(ProtocolId, TimeOut);
+	FileServer server;
+	client.SetTransport(&clientSocket);
+	server.SetTransport(&serverSocket);
+
+	if (!client.Start(ClientPort) || !server.Start(ServerPort))
+	{
+		printf("could not start simulated connections\n");
+		return 1;
+	}
+
+	if (UseHandshake)
+	{
+		client.EnableHandshake();
+		server.EnableHandshake();
+		if (UseCompactHeader)
+		{
+			client.EnableCompactHeader();
+			server.EnableCompactHeader();
+		}
+		if (WideAckBits > 32)
+		{
+			client.EnableWideAcks(WideAckBits);
+			server.EnableWideAcks(WideAckBits);
+		}
+	}
+
+	client.Connect(Address(127, 0, 0, 1, ServerPort));
+	client.EnablePathMtuDiscovery();
+
+	printf("simulating transfer of %s (%zu bytes), seed %u\n", fileName, fileContents.size(), seed);
+
+	std::chrono::steady_clock::time_point wallStart = std::chrono::steady_clock::now();
+
+	FlowControl flowControl;
+
+	unsigned char metadataPacket[PacketSize];
+	memset(metadataPacket, 0, PacketSize);
+	snprintf((char*)metadataPacket, PacketSize, "File|%zu|%s", fileContents.size(), fileName);
+	bool metadataSent = false;
+
+	const unsigned char* chunks[MaxPacketBatch];
+	int chunkSizes[MaxPacketBatch];
+	size_t fileOffset = 0;
+	float sendAccumulator = 0.0f;
+	float drainTime = 0.0f;
+	bool crcSent = false;
+
+	while (drainTime < SimulatedDrainTime && !client.ConnectFailed())
+	{
+		network.Update(DeltaTime);
+
+		if (client.IsConnected())
+			flowControl.Update(DeltaTime, client.GetReliabilitySystem().GetRoundTripTime() * 1000.0f);
+
+		const float sendRate = flowControl.GetSendRate();
+		sendAccumulator += DeltaTime;
+
+		// With the handshake nothing is sent until it has connected the client
+		if (!metadataSent && (client.IsConnected() || !client.IsHandshakeEnabled())) {
+			client.SendPacket(metadataPacket, PacketSize);
+			metadataSent = true;
+			sendAccumulator = 0.0f;
+		}
+
+		while (metadataSent && sendAccumulator > 1.0f / sendRate && fileOffset < fileContents.size()) {
+			// Chunks point straight into the file contents, sized to the path mtu found so far
+			const size_t chunkSize = client.GetMaxPayloadSize();
+			int chunkCount = 0;
+			while (chunkCount < MaxPacketBatch && sendAccumulator > 1.0f / sendRate && fileOffset < fileContents.size()) {
+				const size_t bytes = fileContents.size() - fileOffset < chunkSize ? fileContents.size() - fileOffset : chunkSize;
+				chunks[chunkCount] = &fileContents[fileOffset];
+				chunkSizes[chunkCount] = (int)bytes;
+				chunkCount++;
+
+				fileOffset += bytes;
+				sendAccumulator -= 1.0f / sendRate;
+			}
+			client.SendPackets(chunks, chunkSizes, chunkCount);
+		}
+
+		if (fileOffset >= fileContents.size()) {
+			if (!crcSent) {
+				char crcPacket[PacketSize];
+				snprintf(crcPacket, PacketSize, "CRC32|%08X", crc32((const char*)fileContents.data(), fileContents.size()));
+				client.SendPacket((unsigned char*)crcPacket, strlen(crcPacket) + 1);
+				crcSent = true;
+			}
+			drainTime += DeltaTime;
+		}
+
+		ReceiveFilePackets(server);
+
+		unsigned char ackPacket[PacketSize];
+		while (client.ReceivePacket(ackPacket, sizeof(ackPacket)) > 0);
+
+		client.Update(DeltaTime);
+		server.Update(DeltaTime);
+	}
+
+	const float wallTime = std::chrono::duration<float>(std::chrono::steady_clock::now() - wallStart).count();
+	ReliabilitySystem& reliability = client.GetReliabilitySystem();
+
+	printf("simulated %.1f seconds in %.3f seconds of wall time\n", network.GetTime(), wallTime);
+	printf("client: rtt %.1fms, sent %d, acked %d, lost %d, sent bandwidth = %.1fkbps, acked bandwidth = %.1fkbps\n",
+		reliability.GetRoundTripTime() * 1000.0f, reliability.GetSentPackets(), reliability.GetAckedPackets(),
+		reliability.GetLostPackets(), reliability.GetSentBandwidth(), reliability.GetAckedBandwidth());
+	printf("network: sent %d, lost %d, duplicated %d, reordered %d, queue drops %d, mtu drops %d\n",
+		network.GetSentPackets(), network.GetLostPackets(), network.GetDuplicatedPackets(),
+		network.GetReorderedPackets(), network.GetQueueDrops(), network.GetMtuDrops());
+	printf("path mtu %d bytes\n", client.GetPathMtu());
+	Session* session = server.FindSession(Address(127, 0, 0, 1, ClientPort));
+	printf("server received %zu of %zu bytes\n", session ? FileServer::GetTransfer(*session).fileData.size() : 0, fileContents.size());
+
+	return 0;
+}
+
+/*
+ * FUNCTION   : RunBenchmark
+ * DESCRIPTION: Initializes sockets and runs the benchmark with the given name.
+ * PARAMETERS :
+ *   - name : The benchmark to run.
+ * RETURNS    :
+ *   - 0 when the benchmark ran, 1 on error or an unknown name.
+ */
+int RunBenchmark(const char* name)
+{
+	if (!InitializeSockets())
+	{
+		printf("failed to initialize sockets\n");
+		return 1;
+	}
+
+	int result = 1;
+	if (strcmp(name, "ring") == 0)
+		result = BenchRing();
+	else if (strcmp(name, "connected") == 0)
+		result = BenchConnected();
+	else if (strcmp(name, "shards") == 0)
+		result = BenchShards();
+	else if (strcmp(name, "zerocopy") == 0)
+		result = BenchZeroCopy();
+	else if (strcmp(name, "latency") == 0)
+		result = BenchLatency();
+	else if (strcmp(name, "sessions") == 0)
+		result = BenchSessions();
+	else if (strcmp(name, "segments") == 0)
+		result = BenchSegments();
+	else if (strcmp(name, "reliability") == 0)
+		result = BenchReliability();
+	else
+		printf("unknown benchmark %s\n", name);
+
+	ShutdownSockets();
+	return result;
+}
+
+/*
+ * FUNCTION   : OpenBenchSockets
+ * DESCRIPTION: Opens a sender on BenchPort and a receiver on the port after it, with kernel
+ *              buffers large enough to hold a whole batch of benchmark datagrams.
+ * PARAMETERS :
+ *   - sender   : The socket to open for sending.
+ *   - receiver : The socket to open for receiving.
+ * RETURNS    :
+ *   - true when both sockets are open.
+ */
+bool OpenBenchSockets(Socket& sender, Socket& receiver)
+{
+	if (!sender.Open(BenchPort) || !receiver.Open(BenchPort + 1))
+	{
+		printf("could not open benchmark sockets on ports %d and %d\n", BenchPort, BenchPort + 1);
+		return false;
+	}
+	sender.SetBufferSizes(SocketBufferSize, SocketBufferSize);
+	receiver.SetBufferSizes(SocketBufferSize, SocketBufferSize);
+	return true;
+}
+
+/*
+ * FUNCTION   : BenchRing
+ * DESCRIPTION: Sends BenchDatagrams loopback datagrams in batches and times receiving them,
+ *              once with recvfrom per datagram and once from the io_uring multishot receive.
+ *              The send is timed too: io_uring fills its buffers while the sender is in the
+ *              kernel, so timing the receive loop alone would miss most of its work.
+ * RETURNS    :
+ *   - 0 when the benchmark ran, 1 on error.
+ */
+int BenchRing()
+{
+	unsigned char payload[BenchPayload];
+	memset(payload, 0xA5, sizeof(payload));
+	Datagram batch[MaxPacketBatch];
+	for (int i = 0; i < MaxPacketBatch; ++i)
+	{
+		batch[i].address = Address(127, 0, 0, 1, BenchPort + 1);
+		batch[i].data = payload;
+		batch[i].size = BenchPayload;
+		batch[i].timestamp = 0;
+	}
+
+	for (int backend = 0; backend < 2; ++backend)
+	{
+		Socket sender;
+		Socket receiver;
+		if (!OpenBenchSockets(sender, receiver))
+			return 1;
+		if (backend == 1 && !receiver.EnableRing())
+		{
+			printf("io_uring: unavailable (build with NET_IO_URING on linux)\n");
+			break;
+		}
+
+		unsigned char buffer[DefaultMaxPacketSize];
+		Address from;
+		int received = 0;
+		long long time = 0;
+		for (int sent = 0; sent < BenchDatagrams; sent += MaxPacketBatch)
+		{
+			const long long start = monotonic_now();
+			const int count = sender.SendBatch(batch, MaxPacketBatch);
+			// loopback sends are queued on the receiver when SendBatch returns, give up on any lost ones
+			for (int got = 0, idle = 0; got < count && idle < 100000;)
+			{
+				if (receiver.Receive(from, buffer, sizeof(buffer)) > 0)
+				{
+					got++;
+					received++;
+					idle = 0;
+				}
+				else
+					idle++;
+			}
+			time += monotonic_now() - start;
+		}
+
+		printf("%s: received %d of %d datagrams, %.0f ns per datagram\n", backend == 0 ? "recvfrom" : "io_uring",
+			received, BenchDatagrams, received > 0 ? (double)time / received : 0.0);
+	}
+	return 0;
+}
+
+/*
+ * FUNCTION   : BenchConnected
+ * DESCRIPTION: Times BenchDatagrams single datagram sends to the loopback receiver, once with
+ *              sendto and once after connecting the sender to the receiver, when Send takes
+ *              the send() fast path that skips the per-packet address and route lookup.
+ *              The receiver is drained between batches, outside the timing.
+ * RETURNS    :
+ *   - 0 when the benchmark ran, 1 on error.
+ */
+int BenchConnected()
+{
+	unsigned char payload[BenchPayload];
+	memset(payload, 0xA5, sizeof(payload));
+	const Address destination(127, 0, 0, 1, BenchPort + 1);
+
+	for (int connected = 0; connected < 2; ++connected)
+	{
+		Socket sender;
+		Socket receiver;
+		if (!OpenBenchSockets(sender, receiver))
+			return 1;
+		if (connected && !sender.Connect(destination))
+			return 1;
+
+		int sent = 0;
+		long long time = 0;
+		for (int i = 0; i < BenchDatagrams; i += MaxPacketBatch)
+		{
+			const long long start = monotonic_now();
+			for (int j = 0; j < MaxPacketBatch; ++j)
+				sent += sender.Send(destination, payload, sizeof(payload)) ? 1 : 0;
+			time += monotonic_now() - start;
+			DrainSocket(receiver);
+		}
+
+		printf("%s: sent %d of %d datagrams, %.0f ns per send\n", connected ? "connected send" : "sendto",
+			sent, BenchDatagrams, sent > 0 ? (double)time / sent : 0.0);
+	}
+	return 0;
+}
+
+/*
+ * FUNCTION   : DrainSocket
+ * DESCRIPTION: Receives and discards every datagram waiting on the socket, so benchmark
+ *              sends never find the receive buffer full.
+ * PARAMETERS :
+ *   - socket : The socket to drain.
+ * RETURNS    :
+ *   - Nothing.
+ */
+void DrainSocket(Socket& socket)
+{
+	unsigned char buffer[DefaultMaxPacketSize];
+	Address from;
+	while (socket.Receive(from, buffer, sizeof(buffer)) > 0);
+}
+
+/*
+ * FUNCTION   : BenchShards
+ * DESCRIPTION: Runs 1, 2 and 4 server shards sharing a loopback port for BenchTime seconds
+ *              each, with one thread of BenchClients clients sending per shard, and reports
+ *              how many packets per second the shards receive and process together. Shards
+ *              only scale while there are free cores for them and their senders.
+ * RETURNS    :
+ *   - 0 when the benchmark ran.
+ */
+int BenchShards()
+{
+	printf("%u hardware threads\n", thread::hardware_concurrency());
+
+	for (int shards = 1; shards <= 4; shards *= 2)
+	{
+		atomic<bool> running(true);
+		atomic<int> ready(0);
+		atomic<long long> processed(0);
+
+		// every shard must be on the port before clients send, or the kernel hashes them all to the first
+		vector<thread> threads;
+		for (int shard = 0; shard < shards; ++shard)
+			threads.push_back(thread(RunBenchShard, &running, &ready, &processed));
+		while (ready < shards)
+			this_thread::yield();
+		if (ready > shards)
+		{
+			printf("%d shards: could not open the port\n", shards);
+			running = false;
+		}
+		else
+		{
+			for (int group = 0; group < shards; ++group)
+				threads.push_back(thread(RunBenchClients, group, &running));
+			this_thread::sleep_for(chrono::duration<float>(BenchTime));
+			running = false;
+		}
+		for (size_t i = 0; i < threads.size(); ++i)
+			threads[i].join();
+
+		printf("%d shards: %.0f packets per second\n", shards, processed / BenchTime);
+	}
+	return 0;
+}
+
+/*
+ * FUNCTION   : RunBenchShard
+ * DESCRIPTION: Opens one shard of the benchmark server on the shared port and receives
+ *              packets, counting each one, until running is cleared.
+ * PARAMETERS :
+ *   - running   : Cleared when the run is over.
+ *   - ready     : Incremented once the shard is on the port, by the shard count if it failed.
+ *   - processed : Packets received by all shards.
+ * RETURNS    :
+ *   - Nothing.
+ */
+void RunBenchShard(atomic<bool>* running, atomic<int>* ready, atomic<long long>* processed)
+{
+	ConnectionManager server(ProtocolId, TimeOut, BenchClients * 4);
+	if (!server.Start(BenchPort + 1, true))
+	{
+		*ready += 4;
+		return;
+	}
+	server.SetBufferSizes(SocketBufferSize, SocketBufferSize);
+	(*ready)++;
+
+	unsigned char packet[DefaultMaxPacketSize];
+	Session* session = nullptr;
+	long long count = 0;
+	while (*running)
+	{
+		if (server.ReceivePacket(session, packet, sizeof(packet)) > 0)
+			count++;
+		else
+			this_thread::yield();
+	}
+	*processed += count;
+}
+
+/*
+ * FUNCTION   : RunBenchClients
+ * DESCRIPTION: Starts BenchClients connections to the benchmark server and sends from each
+ *              of them in turn until running is cleared. Each group binds its own ports.
+ * PARAMETERS :
+ *   - group   : Index of this sending thread.
+ *   - running : Cleared when the run is over.
+ * RETURNS    :
+ *   - Nothing.
+ */
+void RunBenchClients(int group, atomic<bool>* running)
+{
+	vector<ReliableConnection*> clients;
+	for (int i = 0; i < BenchClients; ++i)
+	{
+		ReliableConnection* client = new ReliableConnection(ProtocolId, TimeOut);
+		if (client->Start(BenchPort + 2 + group * BenchClients + i))
+		{
+			client->Connect(Address(127, 0, 0, 1, BenchPort + 1));
+			clients.push_back(client);
+		}
+		else
+			delete client;
+	}
+
+	unsigned char payload[BenchPayload];
+	memset(payload, 0xA5, sizeof(payload));
+	while (*running && !clients.empty())
+	{
+		for (size_t i = 0; i < clients.size(); ++i)
+			clients[i]->SendPacket(payload, sizeof(payload));
+	}
+
+	for (size_t i = 0; i < clients.size(); ++i)
+		delete clients[i];
+}
+
+/*
+ * FUNCTION   : BenchZeroCopy
+ * DESCRIPTION: Times sending a 16 byte header and a payload as one datagram, gathered and
+ *              copied by the kernel or pinned with MSG_ZEROCOPY, at payload sizes from 256
+ *              bytes to 32KB. Zero copy sends are timed until their completions are read.
+ *              The kernel copies on loopback anyway, which the copied count shows, so only a
+ *              run against a real device shows the pinning pay off.
+ * RETURNS    :
+ *   - 0 when the benchmark ran, 1 on error.
+ */
+int BenchZeroCopy()
+{
+	const int sizes[] = { 256, 1472, 8192, 32768 };
+	const int batch = 16;
+	const Address destination(127, 0, 0, 1, BenchPort + 1);
+	unsigned char header[16];
+	memset(header, 0x5A, sizeof(header));
+	vector<unsigned char> payload(32768, 0xA5);
+
+	for (int i = 0; i < 4; ++i)
+	{
+		// fewer datagrams at the larger sizes, so every size moves a similar amount of data
+		const int count = BenchDatagrams / 4 / (sizes[i] < 1472 ? 1 : sizes[i] / 1472);
+
+		for (int zerocopy = 0; zerocopy < 2; ++zerocopy)
+		{
+			Socket sender;
+			Socket receiver;
+			if (!OpenBenchSockets(sender, receiver))
+				return 1;
+			if (zerocopy && !sender.EnableZeroCopy())
+			{
+				printf("%d bytes zero copy: unavailable\n", sizes[i]);
+				continue;
+			}
+
+			Segment segments[2] = { { header, (int)sizeof(header) }, { &payload[0], sizes[i] } };
+			int sent = 0;
+			long long time = 0;
+			for (int j = 0; j < count; j += batch)
+			{
+				const long long start = monotonic_now();
+				for (int k = 0; k < batch && j + k < count; ++k)
+				{
+					unsigned int id;
+					if (zerocopy)
+						sent += sender.SendZeroCopy(destination, header, sizeof(header), &payload[0], sizes[i], id) ? 1 : 0;
+					else
+						sent += sender.SendSegments(destination, segments, 2) ? 1 : 0;
+				}
+				// payload buffers may only be reused once the kernel is done with them
+				while (zerocopy && sender.GetNextZeroCopyId() != 0 && !sender.IsSendComplete(sender.GetNextZeroCopyId() - 1))
+					sender.PollCompletions();
+				time += monotonic_now() - start;
+				DrainSocket(receiver);
+			}
+
+			printf("%d bytes %s: sent %d of %d, %.0f ns per send", sizes[i], zerocopy ? "zero copy" : "copy",
+				sent, count, sent > 0 ? (double)time / sent : 0.0);
+			if (zerocopy)
+				printf(", %u copied by the kernel", sender.GetCopiedSends());
+			printf("\n");
+		}
+	}
+	return 0;
+}
+
+/*
+ * FUNCTION   : BenchLatency
+ * DESCRIPTION: Measures the one-way loopback latency, from the send to the receive loop
+ *              reading it, of BenchPings datagrams sent BenchPingInterval apart. Runs the
+ *              receive loop three ways: sleeping DeltaTime between polls, waiting on the
+ *              event loop, and busy polling the event loop and socket. Reports p50 and p99.
+ *              Busy polling needs a core of its own, the pinger shares it otherwise.
+ * RETURNS    :
+ *   - 0 when the benchmark ran, 1 on error.
+ */
+int BenchLatency()
+{
+	const char* loops[] = { "sleep", "event", "busy poll" };
+
+	for (int loop = 0; loop < 3; ++loop)
+	{
+		Socket sender;
+		Socket receiver;
+		if (!OpenBenchSockets(sender, receiver))
+			return 1;
+
+		Reactor reactor;
+		if (loop > 0 && !reactor.Open(receiver.GetHandle(), DeltaTime))
+			return 1;
+		if (loop == 2)
+		{
+			receiver.EnableBusyPoll(BusyPollTime);
+			reactor.SetBusyPoll(true);
+		}
+
+		vector<long long> latencies;
+		atomic<bool> done(false);
+		thread pinger(RunBenchPinger, &sender, BenchPings, &done);
+
+		// give up on lost pings two ticks after the last one was sent
+		long long deadline = 0;
+		while ((int)latencies.size() < BenchPings && (deadline == 0 || monotonic_now() < deadline))
+		{
+			if (deadline == 0 && done)
+				deadline = monotonic_now() + (long long)(DeltaTime * 2.0f * 1000000000.0f);
+
+			if (loop == 0)
+				wait(DeltaTime);
+			else
+				reactor.Wait();
+
+			long long sent;
+			Address from;
+			while (receiver.Receive(from, &sent, sizeof(sent)) == sizeof(sent))
+				latencies.push_back(monotonic_now() - sent);
+		}
+		pinger.join();
+
+		if (latencies.empty())
+		{
+			printf("%s: no pings received\n", loops[loop]);
+			continue;
+		}
+		sort(latencies.begin(), latencies.end());
+		printf("%s: received %zu of %d, p50 %.1f us, p99 %.1f us\n", loops[loop], latencies.size(), BenchPings,
+			latencies[latencies.size() / 2] / 1000.0, latencies[latencies.size() * 99 / 100] / 1000.0);
+	}
+	return 0;
+}
+
+/*
+ * FUNCTION   : RunBenchPinger
+ * DESCRIPTION: Sends count datagrams holding their send time to the benchmark receiver,
+ *              BenchPingInterval apart.
+ * PARAMETERS :
+ *   - sender : The open socket to send from.
+ *   - count  : Number of datagrams to send.
+ *   - done   : Set once the last datagram is sent.
+ * RETURNS    :
+ *   - Nothing.
+ */
+void RunBenchPinger(Socket* sender, int count, atomic<bool>* done)
+{
+	const Address destination(127, 0, 0, 1, BenchPort + 1);
+	for (int i = 0; i < count; ++i)
+	{
+		wait(BenchPingInterval);
+		const long long now = monotonic_now();
+		sender->Send(destination, &now, sizeof(now));
+	}
+	*done = true;
+}
+
+/*
+ * FUNCTION   : BenchSessions
+ * DESCRIPTION: Times looking sessions up by client address, in random order, with 1k and
+ *              100k sessions held in an AddressTable, a std::map and a std::unordered_map.
+ *              Runs in memory, no sockets are involved.
+ * RETURNS    :
+ *   - 0 when the benchmark ran.
+ */
+int BenchSessions()
+{
+	const int counts[] = { 1000, 100000 };
+	const int lookups = BenchDatagrams * 5;
+
+	for (int i = 0; i < 2; ++i)
+	{
+		// distinct addresses spread over 10.0.0.0/8 (an odd multiplier is a bijection on 24 bits)
+		vector<Address> addresses(counts[i]);
+		for (int j = 0; j < counts[i]; ++j)
+			addresses[j] = Address(0x0A000000 | (((unsigned int)j * 2654435761u) & 0xFFFFFF), (unsigned short)(1024 + j % 50000));
+
+		vector<int> order(lookups);
+		mt19937 random(counts[i]);
+		for (int j = 0; j < lookups; ++j)
+			order[j] = (int)(random() % counts[i]);
+
+		AddressTable<int> table;
+		map<Address, int> tree;
+		unordered_map<Address, int, AddressHash> hashed;
+		for (int j = 0; j < counts[i]; ++j)
+		{
+			table.Insert(addresses[j], j);
+			tree[addresses[j]] = j;
+			hashed[addresses[j]] = j;
+		}
+
+		// the sums keep the lookups from being optimized away, all three must agree
+		long long sums[3] = { 0, 0, 0 };
+		long long times[3];
+		long long start = monotonic_now();
+		for (int j = 0; j < lookups; ++j)
+			sums[0] += *table.Find(addresses[order[j]]);
+		times[0] = monotonic_now() - start;
+		start = monotonic_now();
+		for (int j = 0; j < lookups; ++j)
+			sums[1] += tree.find(addresses[order[j]])->second;
+		times[1] = monotonic_now() - start;
+		start = monotonic_now();
+		for (int j = 0; j < lookups; ++j)
+			sums[2] += hashed.find(addresses[order[j]])->second;
+		times[2] = monotonic_now() - start;
+
+		printf("%d sessions: AddressTable %.1f ns, std::map %.1f ns, std::unordered_map %.1f ns per lookup%s\n", counts[i],
+			(double)times[0] / lookups, (double)times[1] / lookups, (double)times[2] / lookups,
+			sums[0] == sums[1] && sums[1] == sums[2] ? "" : " (lookups disagree)");
+	}
+	return 0;
+}
+
+/*
+ * FUNCTION   : BenchSegments
+ * DESCRIPTION: Times moving BenchDatagrams payloads with a 16 byte header (protocol id and
+ *              reliability header) across loopback, at 256 bytes and the largest payload a
+ *              DefaultMaxPacketSize datagram holds. Once as segments, the header and payload
+ *              gathered on send and scattered on receive, and once copied into and out of a
+ *              staging buffer around plain Send and Receive.
+ * RETURNS    :
+ *   - 0 when the benchmark ran, 1 on error.
+ */
+int BenchSegments()
+{
+	const int headerSize = 16;
+	const int sizes[] = { BenchPayload, DefaultMaxPacketSize - headerSize };
+	const Address destination(127, 0, 0, 1, BenchPort + 1);
+	unsigned char header[headerSize];
+	memset(header, 0x5A, sizeof(header));
+	vector<unsigned char> payload(DefaultMaxPacketSize, 0xA5);
+	vector<unsigned char> received(DefaultMaxPacketSize);
+	vector<unsigned char> staging(DefaultMaxPacketSize);
+
+	for (int i = 0; i < 2; ++i)
+	{
+		for (int segmented = 0; segmented < 2; ++segmented)
+		{
+			Socket sender;
+			Socket receiver;
+			if (!OpenBenchSockets(sender, receiver))
+				return 1;
+
+			Segment send[2] = { { header, headerSize }, { &payload[0], sizes[i] } };
+			unsigned char receivedHeader[headerSize];
+			Segment receive[2] = { { receivedHeader, headerSize }, { &received[0], (int)received.size() } };
+			Address from;
+			int moved = 0;
+
+			const long long start = monotonic_now();
+			for (int j = 0; j < BenchDatagrams; ++j)
+			{
+				if (segmented)
+				{
+					sender.SendSegments(destination, send, 2);
+					moved += receiver.ReceiveSegments(from, receive, 2) == headerSize + sizes[i] ? 1 : 0;
+				}
+				else
+				{
+					memcpy(&staging[0], header, headerSize);
+					memcpy(&staging[headerSize], &payload[0], sizes[i]);
+					sender.Send(destination, &staging[0], headerSize + sizes[i]);
+					const int bytes = receiver.Receive(from, &staging[0], (int)staging.size());
+					if (bytes == headerSize + sizes[i])
+					{
+						memcpy(receivedHeader, &staging[0], headerSize);
+						memcpy(&received[0], &staging[headerSize], bytes - headerSize);
+						moved++;
+					}
+				}
+			}
+			const long long time = monotonic_now() - start;
+
+			printf("%d bytes %s: moved %d of %d, %.0f ns per datagram\n", sizes[i], segmented ? "segments" : "copy",
+				moved, BenchDatagrams, moved > 0 ? (double)time / moved : 0.0);
+		}
+	}
+	return 0;
+}
+
+/*
+ * FUNCTION   : BenchReliability
+ * DESCRIPTION: Times the reliability system's PacketSent, PacketReceived and ProcessAck at
+ *              10k packets per second of simulated time, with Update called every 100
+ *              packets. Acks come back 2000 packets late with 1% loss, so ProcessAck works
+ *              against a full window of unacked packets. ProcessAck runs with 32 bit and
+ *              WideAckBits wide ack bitfields. Runs in memory, no sockets are involved.
+ * RETURNS    :
+ *   - 0 when the benchmark ran.
+ */
+int BenchReliability()
+{
+	const int count = BenchDatagrams;
+	const int tick = 100;
+	const float tickTime = tick / 10000.0f;
+	const int lag = 2000;
+
+	ReliabilitySystem sender;
+	long long updateTime = 0;
+	long long start = monotonic_now();
+	for (int i = 0; i < count; ++i)
+	{
+		sender.PacketSent(PacketSize);
+		if (i % tick == tick - 1)
+		{
+			const long long update = monotonic_now();
+			sender.Update(tickTime);
+			updateTime += monotonic_now() - update;
+		}
+	}
+	printf("PacketSent: %.1f ns per packet, Update %.1f ns per packet\n",
+		(double)(monotonic_now() - start - updateTime) / count, (double)updateTime / count);
+
+	// 1% of packets lost and 1% arriving two late
+	ReliabilitySystem receiver;
+	mt19937 random(1);
+	unsigned int ackWords = 0;
+	start = monotonic_now();
+	for (int i = 0; i < count; ++i)
+	{
+		const unsigned int roll = random() % 100;
+		if (roll == 0)
+			continue;
+		receiver.PacketReceived(roll == 1 && i > 2 ? i - 2 : i, PacketSize);
+		ackWords += receiver.GetAckBits().GetWord(0);
+		if (i % tick == tick - 1)
+			receiver.Update(tickTime);
+	}
+	printf("PacketReceived: %.1f ns per packet (ack bits %08X)\n", (double)(monotonic_now() - start) / count, ackWords);
+
+	const int widths[] = { 32, WideAckBits };
+	for (int w = 0; w < 2; ++w)
+	{
+		ReliabilitySystem local;
+		ReliabilitySystem remote;
+		long long ackTime = 0;
+		for (int i = 0; i < count; ++i)
+		{
+			local.PacketSent(PacketSize);
+			if (i >= lag)
+			{
+				if (random() % 100 != 0)
+					remote.PacketReceived(i - lag, PacketSize);
+
+				// only the bits the header would carry at this width
+				AckBits bits;
+				bits.Clear();
+				for (int word = 0; word < widths[w] / 32; ++word)
+					bits.SetWord(word, remote.GetAckBits().GetWord(word));
+
+				const long long ack = monotonic_now();
+				local.ProcessAck(remote.GetRemoteSequence(), bits);
+				ackTime += monotonic_now() - ack;
+			}
+			if (i % tick == tick - 1)
+			{
+				local.Update(tickTime);
+				remote.Update(tickTime);
+			}
+		}
+		printf("ProcessAck, %d ack bits: %.1f ns per ack, acked %u, lost %u\n", widths[w],
+			(double)ackTime / (count - lag), local.GetAckedPackets(), local.GetLostPackets());
+	}
+	return 0;
+}
+
 /*
  * FUNCTION   : crc32
  * DESCRIPTION: Computes the CRC32 checksum of the given input data. The checksum is used